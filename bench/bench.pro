@@ -0,0 +1,46 @@
+# End-to-end upload benchmark against a pty bootloader simulator (Linux only)
+
+QT       = core serialport
+CONFIG  += console c++11
+CONFIG  -= app_bundle
+
+TARGET = c45b-bench
+
+!linux: error("The bootloader simulator needs Linux pseudo-terminals")
+
+DEFINES += QT_DEPRECATED_WARNINGS
+# keep protocol logging out of the measured loop
+DEFINES += C45B_LOG_LEVEL=C45B_LOG_LEVEL_WARNING
+INCLUDEPATH += ..
+
+SOURCES += \
+    ../common/hexencoder.cpp \
+    ../common/hexfile.cpp \
+    ../common/hexfiletester.cpp \
+    ../common/hexutils.cpp \
+    ../common/imagecache.cpp \
+    ../common/log.cpp \
+    ../common/uploadtrace.cpp \
+    ../gangprogrammer.cpp \
+    ../linesender.cpp \
+    ../progressmeter.cpp \
+    ../serial.cpp \
+    ../serialthread.cpp \
+    bootloadersimulator.cpp \
+    main.cpp
+
+HEADERS += \
+    ../commands.h \
+    ../common/hexencoder.h \
+    ../common/hexfile.h \
+    ../common/hexfiletester.h \
+    ../common/hexutils.h \
+    ../common/imagecache.h \
+    ../common/log.h \
+    ../common/uploadtrace.h \
+    ../gangprogrammer.h \
+    ../linesender.h \
+    ../progressmeter.h \
+    ../serial.h \
+    ../serialthread.h \
+    bootloadersimulator.h
@@ -0,0 +1,292 @@
+// This file is part of c45b.
+
+// c45b is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// c45b is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with c45b.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <QMutexLocker>
+
+#include "bootloadersimulator.h"
+#include "common/hexutils.h"
+
+static const char XON = 0x11;
+static const char XOFF = 0x13;
+
+BootloaderSimulator::BootloaderSimulator(QObject *parent) : QThread(parent)
+{
+}
+
+BootloaderSimulator::~BootloaderSimulator()
+{
+    stop();
+    wait();
+    if (m_slave >= 0)
+        ::close(m_slave);
+    if (m_master >= 0)
+        ::close(m_master);
+}
+
+bool BootloaderSimulator::open()
+{
+    m_master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (m_master < 0 || grantpt(m_master) != 0 || unlockpt(m_master) != 0)
+    {
+        m_lastError = QString("Could not create pty: %1").arg(strerror(errno));
+        return false;
+    }
+    m_slaveName = QString::fromLocal8Bit(ptsname(m_master));
+
+    // Keep the slave open ourselves so the master never sees a hangup
+    // between host sessions, and make it raw so nothing is echoed back
+    m_slave = ::open(ptsname(m_master), O_RDWR | O_NOCTTY);
+    if (m_slave < 0)
+    {
+        m_lastError = QString("Could not open %1: %2").arg(m_slaveName, strerror(errno));
+        return false;
+    }
+    termios tio;
+    tcgetattr(m_slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(m_slave, TCSANOW, &tio);
+    return true;
+}
+
+void BootloaderSimulator::stop()
+{
+    m_stop.store(1);
+}
+
+HexFile BootloaderSimulator::memory(bool eeprom) const
+{
+    QMutexLocker locker(&m_memoryLock);
+    return eeprom ? m_eeprom : m_flash;
+}
+
+void BootloaderSimulator::clearMemory()
+{
+    QMutexLocker locker(&m_memoryLock);
+    m_flash = HexFile();
+    m_eeprom = HexFile();
+}
+
+qint32 BootloaderSimulator::hostBaudRate() const
+{
+    termios tio;
+    if (tcgetattr(m_master, &tio) != 0)
+        return 0;
+    switch (cfgetispeed(&tio))
+    {
+    case B9600: return 9600;
+    case B19200: return 19200;
+    case B38400: return 38400;
+    case B57600: return 57600;
+    case B115200: return 115200;
+    case B230400: return 230400;
+    case B460800: return 460800;
+    case B500000: return 500000;
+    case B921600: return 921600;
+    case B1000000: return 1000000;
+    default: return 0;  // custom (BOTHER) or unknown; assume it matches
+    }
+}
+
+void BootloaderSimulator::pace(int bytes)
+{
+    if (m_baudRate <= 0)
+        return;
+    // 8N2 framing: 11 bit times per character
+    const qint64 now = m_clock.nsecsElapsed();
+    m_wireClock = qMax(m_wireClock, now) + qint64(bytes) * 11 * 1000000000LL / m_baudRate;
+    if (m_wireClock > now)
+        QThread::usleep(static_cast<unsigned long>((m_wireClock - now) / 1000));
+}
+
+void BootloaderSimulator::send(const QByteArray& data)
+{
+    pace(data.size());
+    const char* p = data.constData();
+    int left = data.size();
+    while (left > 0)
+    {
+        const ssize_t n = ::write(m_master, p, left);
+        if (n < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return;
+        }
+        p += n;
+        left -= static_cast<int>(n);
+    }
+}
+
+void BootloaderSimulator::run()
+{
+    m_clock.start();
+    char buffer[4096];
+    while (!m_stop.load())
+    {
+        pollfd fd = {m_master, POLLIN, 0};
+        if (poll(&fd, 1, 50) <= 0 || !(fd.revents & POLLIN))
+            continue;
+        const ssize_t n = ::read(m_master, buffer, sizeof(buffer));
+        if (n <= 0)
+            continue;
+        m_bytesIn.fetchAndAddRelaxed(n);
+        pace(static_cast<int>(n));
+
+        const qint32 host = hostBaudRate();
+        if (m_baudRate > 0 && host > 0 && host != m_baudRate)
+        {
+            // a UART sampling at the wrong rate produces framing garbage
+            m_line.clear();
+            send(QByteArray("\xF0\x80\x0F", 3));
+            continue;
+        }
+        for (ssize_t i = 0; i < n; ++i)
+        {
+            if (buffer[i] == '\n')
+            {
+                handleLine(m_line);
+                m_line.clear();
+            }
+            else if (buffer[i] != '\r')
+                m_line.append(buffer[i]);
+        }
+    }
+}
+
+void BootloaderSimulator::handleLine(const QByteArray& line)
+{
+    if (m_mode == Mode::Flash || m_mode == Mode::Eeprom)
+    {
+        handleRecord(line);
+        return;
+    }
+
+    if (!line.isEmpty() && line.count('U') == line.size())
+    {
+        m_mode = Mode::Command;
+        send("c45b2 v1.2 (simulated)\n\r>");
+        return;
+    }
+    if (m_mode == Mode::Idle)
+        return;
+
+    if (line == "pf" || line == "pe")
+    {
+        m_mode = line == "pf" ? Mode::Flash : Mode::Eeprom;
+        m_segment = 0;
+        m_page = -1;
+        m_uploadRecords = 0;
+        send(line + "+\n\r>");
+    }
+    else if (line == "g")
+    {
+        send("g+\n\r>");
+        m_mode = Mode::Idle;
+    }
+    else
+        send(QByteArray(1, XOFF) + "-\n\r>" + QByteArray(1, XON));
+}
+
+void BootloaderSimulator::handleRecord(const QByteArray& line)
+{
+    // byte count, address, type, data, checksum
+    quint8 record[5 + 255];
+    const int recordBytes = (line.size() - 1) / 2;
+    bool ok = line.size() >= 11 && line[0] == ':' && (line.size() & 1) && recordBytes <= 5 + 255;
+    quint8 checksum = 0;
+    for (int i = 0; ok && i < recordBytes; ++i)
+    {
+        const unsigned char high = HEX_NIBBLE[static_cast<unsigned char>(line[1 + 2*i])];
+        const unsigned char low = HEX_NIBBLE[static_cast<unsigned char>(line[2 + 2*i])];
+        ok = !((high | low) & HEX_INVALID);
+        record[i] = (high << 4) | (low & 0x0F);
+        checksum += record[i];
+    }
+    ok = ok && checksum == 0 && record[0] + 5 == recordBytes;
+
+    const quint8 type = ok ? record[3] : 0;
+    if (ok && type == 0 && ++m_uploadRecords == m_failAtRecord)
+        ok = false;
+    if (!ok)
+    {
+        send("-\n\r>");
+        m_mode = Mode::Command;
+        return;
+    }
+
+    switch (type)
+    {
+    case 0:
+    {
+        const quint32 address = (m_segment << 4) + ((record[1] << 8) | record[2]);
+        m_records.fetchAndAddRelaxed(1);
+        if (m_mode == Mode::Eeprom)
+        {
+            {
+                QMutexLocker locker(&m_memoryLock);
+                m_eeprom.setBytes(address, record + 4, record[0]);
+            }
+            // EEPROM is written record by record
+            m_page = 0;
+            commitPage();
+            break;
+        }
+        const qint64 page = address / m_pageSize;
+        if (m_page >= 0 && page != m_page)
+            commitPage();
+        m_page = page;
+        {
+            QMutexLocker locker(&m_memoryLock);
+            m_flash.setBytes(address, record + 4, record[0]);
+        }
+        send(".");
+        break;
+    }
+    case 2:
+        m_segment = (record[4] << 8) | record[5];
+        send(".");
+        break;
+    case 1:
+        if (m_page >= 0 && m_mode == Mode::Flash)
+            commitPage();
+        send("\n\r>");
+        m_mode = Mode::Command;
+        break;
+    default:
+        send("-\n\r>");
+        m_mode = Mode::Command;
+        break;
+    }
+}
+
+void BootloaderSimulator::commitPage()
+{
+    // the host must hold off while the page is being written
+    send(QByteArray(1, XOFF));
+    if (m_pageLatency > 0)
+        QThread::usleep(m_pageLatency);
+    send(QByteArray("*") + XON);
+    m_pages.fetchAndAddRelaxed(1);
+    m_page = -1;
+}
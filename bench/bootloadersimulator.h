@@ -0,0 +1,112 @@
+// This file is part of c45b.
+
+// c45b is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// c45b is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with c45b.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef BOOTLOADERSIMULATOR_H
+#define BOOTLOADERSIMULATOR_H
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QString>
+#include <QThread>
+
+#include "common/hexfile.h"
+
+// c45b2 bootloader on the master side of a Linux pseudo-terminal. Open the
+// slave (portName()) with Serial like a real port. Implements the UUUU
+// handshake, pf/pe/g, the '.', '*' and '-' replies and XON/XOFF around page
+// writes, and can pace the line to a baud rate, delay page writes and fail on
+// purpose.
+class BootloaderSimulator : public QThread
+{
+    Q_OBJECT
+public:
+    explicit BootloaderSimulator(QObject *parent = nullptr);
+    ~BootloaderSimulator();
+
+    // Creates the pty; call before start()
+    bool open();
+    void stop();
+
+    QString portName() const {return m_slaveName;}
+    QString errorString() const {return m_lastError;}
+
+    // Rate the "crystal" runs at. The host must use the same rate or it only
+    // gets noise back; the line is paced to it. 0 accepts any rate unpaced.
+    void setBaudRate(qint32 baudRate) {m_baudRate = baudRate;}
+    void setPageSize(int bytes) {m_pageSize = qMax(bytes, 1);}
+    // Time the device is busy (XOFF) per flash page or EEPROM record
+    void setPageWriteLatency(int microseconds) {m_pageLatency = qMax(microseconds, 0);}
+    // Reply '-' to this data record (counted from 1 per upload); 0 never fails
+    void setFailAtRecord(int record) {m_failAtRecord = record;}
+
+    int pagesWritten() const {return m_pages.load();}
+    int recordsReceived() const {return m_records.load();}
+    qint64 bytesReceived() const {return m_bytesIn.load();}
+
+    // What has been programmed so far
+    HexFile memory(bool eeprom) const;
+    // Erases flash and EEPROM back to blank
+    void clearMemory();
+
+protected:
+    void run() override;
+
+private:
+    enum class Mode : quint8
+    {
+        Idle,
+        Command,
+        Flash,
+        Eeprom,
+    };
+
+    void handleLine(const QByteArray& line);
+    void handleRecord(const QByteArray& line);
+    void commitPage();
+    void send(const QByteArray& data);
+    void pace(int bytes);
+    qint32 hostBaudRate() const;
+
+    int m_master = -1;
+    int m_slave = -1;
+    QString m_slaveName;
+    QString m_lastError;
+
+    qint32 m_baudRate = 0;
+    int m_pageSize = 128;
+    int m_pageLatency = 0;
+    int m_failAtRecord = 0;
+
+    Mode m_mode = Mode::Idle;
+    QByteArray m_line;
+    quint32 m_segment = 0;
+    qint64 m_page = -1;
+    int m_uploadRecords = 0;
+    QElapsedTimer m_clock;
+    qint64 m_wireClock = 0;
+
+    mutable QMutex m_memoryLock;
+    HexFile m_flash;
+    HexFile m_eeprom;
+
+    QAtomicInt m_stop;
+    QAtomicInt m_pages;
+    QAtomicInt m_records;
+    QAtomicInteger<qint64> m_bytesIn;
+};
+
+#endif // BOOTLOADERSIMULATOR_H
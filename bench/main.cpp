@@ -0,0 +1,591 @@
+// This file is part of c45b.
+
+// c45b is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// c45b is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with c45b.  If not, see <http://www.gnu.org/licenses/>.
+
+// End-to-end upload benchmark against the pty bootloader simulator:
+//   c45b-bench --baud 115200 --sizes 4096,32768,131072 --latency 4500
+// or, without the simulator, HEX decoding speed against the old decoder:
+//   c45b-bench --load-file firmware.hex
+// or the HexFile self checks on a random image, exit code 1 on failure:
+//   c45b-bench --check
+// or measured throughput per upload record length:
+//   c45b-bench --record-lengths 16,32,64,128,255 --sizes 65536
+// or the cost of upload tracing, each size traced and untraced:
+//   c45b-bench --trace-overhead
+// or repeated connects at 9600 baud, each programming straight from the
+// connected() slot while surplus probes may still be answered:
+//   c45b-bench --handshake-runs 20
+// or flash and EEPROM as one queued session against two separate sessions:
+//   c45b-bench --session --sizes 32768
+// or one image programmed into a panel of simulated boards by GangProgrammer,
+// compared with programming the same boards one after another:
+//   c45b-bench --ports 8 --sizes 32768
+
+#include <iostream>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QRandomGenerator>
+#include <QTemporaryDir>
+#include <QTimer>
+
+#include "bootloadersimulator.h"
+#include "common/hexfiletester.h"
+#include "common/hexutils.h"
+#include "common/uploadtrace.h"
+#include "gangprogrammer.h"
+#include "serial.h"
+#include "serialthread.h"
+
+using namespace std;
+
+namespace
+{
+
+struct Result
+{
+    bool ok = false;
+    QString error;
+    qint64 connectNs = 0;
+    // from the handshake to the end of the last upload
+    qint64 uploadNs = 0;
+    // from the handshake to the end of the whole session
+    qint64 sessionNs = 0;
+    // from the "pf+" reply to the first record handed to the port
+    qint64 firstByteNs = -1;
+};
+
+void startConnect(Serial* port, const QString& name, qint32 baudRate)
+{
+    if (!port->tryConnectToBootloader(name, baudRate))
+        emit port->connected(false, "Could not open "+name);
+}
+
+void startConnect(SerialThread* port, const QString& name, qint32 baudRate)
+{
+    port->tryConnectToBootloader(name, baudRate);
+}
+
+qint64 firstWriteLatency(const Serial* port)
+{
+    return port->trace().firstWriteLatency();
+}
+
+qint64 firstWriteLatency(const SerialThread* port)
+{
+    return port->firstWriteLatency();
+}
+
+// Connects, runs jobs as one queued session straight from the connected()
+// slot and waits for it to finish, timing each phase. Every mode that talks
+// to a board goes through here.
+template<typename Port>
+Result runSession(Port* port, const QString& name, qint32 baudRate, const QList<Serial::Job>& jobs)
+{
+    Result result;
+    QEventLoop loop;
+    QElapsedTimer timer;
+    bool connecting = true;
+
+    QObject context;
+    QObject::connect(port, &Port::connected, &context, [&](bool ok, const QString& msg) {
+        if (!connecting)
+            return;
+        connecting = false;
+        result.connectNs = timer.nsecsElapsed();
+        if (!ok)
+        {
+            result.error = msg;
+            loop.quit();
+            return;
+        }
+        timer.start();
+        port->runJobs(jobs);
+    });
+    QObject::connect(port, &Port::firmwareUploaded, &context, [&](bool, const QString&) {
+        result.uploadNs = timer.nsecsElapsed();
+    });
+    QObject::connect(port, &Port::jobsFinished, &context, [&](bool ok, const QString& msg) {
+        result.sessionNs = timer.nsecsElapsed();
+        result.ok = ok;
+        result.error = msg;
+        loop.quit();
+    });
+
+    timer.start();
+    startConnect(port, name, baudRate);
+    QTimer::singleShot(10 * 60 * 1000, &loop, &QEventLoop::quit);
+    loop.exec();
+    // let the "g" reply close the port before the next run
+    QTimer::singleShot(50, &loop, &QEventLoop::quit);
+    loop.exec();
+    result.firstByteNs = firstWriteLatency(port);
+    return result;
+}
+
+// Uploads image and starts the application
+template<typename Port>
+Result upload(Port* port, const QString& name, qint32 baudRate, const HexFile& image, bool doFlash = true)
+{
+    return runSession(port, name, baudRate, {Serial::Job::program(image, doFlash), Serial::Job::startApplication()});
+}
+
+HexFile randomImage(quint32 size)
+{
+    HexFile image;
+    QByteArray data(static_cast<int>(size), Qt::Uninitialized);
+    for (char& c : data)
+        c = static_cast<char>(QRandomGenerator::global()->bounded(256));
+    image.setBytes(0, reinterpret_cast<const quint8*>(data.constData()), size);
+    return image;
+}
+
+// Comma separated list option without empty entries
+QStringList listOption(const QCommandLineParser& parser, const QString& name)
+{
+    QStringList items;
+    for (const QString& item : parser.value(name).split(','))
+    {
+        if (!item.isEmpty())
+            items.append(item);
+    }
+    return items;
+}
+
+// The image of the modes that only use the first of --sizes
+HexFile firstSizeImage(const QCommandLineParser& parser)
+{
+    return randomImage(listOption(parser, "sizes").value(0, "32768").toUInt());
+}
+
+// Opens, configures and starts a simulator from the command line options,
+// running at baudRate
+bool startSimulator(BootloaderSimulator& simulator, const QCommandLineParser& parser, qint32 baudRate)
+{
+    if (!simulator.open())
+    {
+        cerr << simulator.errorString().toLocal8Bit().constData() << endl;
+        return false;
+    }
+    simulator.setBaudRate(baudRate);
+    simulator.setPageWriteLatency(parser.value("latency").toInt());
+    simulator.setPageSize(parser.value("page-size").toInt());
+    simulator.setFailAtRecord(parser.value("fail-at").toInt());
+    simulator.start();
+    return true;
+}
+
+// One simulated board and the host side under test, Serial on the main
+// thread or SerialThread, for the modes that program a single board
+class Bench
+{
+public:
+    explicit Bench(const QCommandLineParser& parser)
+        : m_baudRate(parser.value("baud").toInt()), m_sameThread(parser.isSet("same-thread"))
+    {
+        // Simulated UI load on the main thread
+        const int load = parser.value("load").toInt();
+        QObject::connect(&m_loadTimer, &QTimer::timeout, [load]() {
+            QElapsedTimer busy;
+            busy.start();
+            while (busy.elapsed() < load) {}
+        });
+        if (load > 0)
+            m_loadTimer.start(16);
+    }
+
+    bool start(const QCommandLineParser& parser) {return startSimulator(m_simulator, parser, m_baudRate);}
+
+    BootloaderSimulator& simulator() {return m_simulator;}
+
+    Result run(const QList<Serial::Job>& jobs)
+    {
+        return m_sameThread ? runSession(&m_serial, m_simulator.portName(), m_baudRate, jobs)
+                            : runSession(&m_serialThread, m_simulator.portName(), m_baudRate, jobs);
+    }
+
+    Result upload(const HexFile& image, bool doFlash = true)
+    {
+        return run({Serial::Job::program(image, doFlash), Serial::Job::startApplication()});
+    }
+
+    void setRecordLength(int bytes)
+    {
+        m_serial.setRecordLength(bytes);
+        m_serialThread.setRecordLength(bytes);
+    }
+
+    void setTracing(bool enabled)
+    {
+        m_serial.setTracing(enabled);
+        m_serialThread.setTracing(enabled);
+    }
+
+    bool exportTrace(const QString& fileName) const
+    {
+        return m_sameThread ? m_serial.trace().exportChromeTrace(fileName) : m_serialThread.exportTrace(fileName);
+    }
+
+    QString pageLatencyReport() const
+    {
+        return m_sameThread ? m_serial.trace().pageLatencyReport() : m_serialThread.pageLatencyReport();
+    }
+
+private:
+    qint32 m_baudRate;
+    bool m_sameThread;
+    QTimer m_loadTimer;
+    BootloaderSimulator m_simulator;
+    Serial m_serial;
+    SerialThread m_serialThread;
+};
+
+// Cost of a tracepoint, enabled and disabled, against an empty loop
+void benchmarkTracepoint(int events = 10000000)
+{
+    UploadTrace trace;
+    volatile quint32 sink = 0;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < events; ++i)
+        sink = sink + i;
+    const qint64 baseline = timer.nsecsElapsed();
+
+    for (bool enabled : {true, false})
+    {
+        trace.setEnabled(enabled);
+        timer.start();
+        for (int i = 0; i < events; ++i)
+        {
+            sink = sink + i;
+            trace.record(UploadTrace::Event::RecordAck, i);
+        }
+        const qint64 elapsed = timer.nsecsElapsed();
+        cout << (enabled ? "enabled: " : "disabled: ") << double(elapsed - baseline) / events << " ns per event" << endl;
+    }
+}
+
+// Programs image into portCount simulators at once with GangProgrammer, then
+// into each of them alone, and compares the panel time with the sum
+int benchmarkGang(const QCommandLineParser& parser, int portCount, const HexFile& image)
+{
+    const qint32 baudRate = parser.value("baud").toInt();
+    QObject context;
+    QVector<BootloaderSimulator*> simulators;
+    QStringList ports;
+    for (int i = 0; i < portCount; ++i)
+    {
+        BootloaderSimulator* simulator = new BootloaderSimulator(&context);
+        if (!startSimulator(*simulator, parser, baudRate))
+            return 1;
+        simulators.append(simulator);
+        ports.append(simulator->portName());
+    }
+
+    GangProgrammer gang(parser.value("gang-threads").toInt());
+    QEventLoop loop;
+    int succeeded = 0;
+    QObject::connect(&gang, &GangProgrammer::portFinished, &context, [](const QString& port, bool ok, const QString& msg) {
+        if (!ok)
+            cout << port.toLocal8Bit().constData() << " failed: " << msg.toLocal8Bit().constData() << endl;
+    });
+    QObject::connect(&gang, &GangProgrammer::finished, &context, [&](int ok, int) {
+        succeeded = ok;
+        loop.quit();
+    });
+    QElapsedTimer timer;
+    timer.start();
+    if (!gang.start(ports, baudRate, image, true))
+        return 1;
+    loop.exec();
+    const double panelSeconds = timer.nsecsElapsed() / 1e9;
+    int failures = portCount - succeeded;
+    for (const BootloaderSimulator* simulator : simulators)
+    {
+        if (!simulator->memory(false).diffPages(image).isEmpty())
+            ++failures;
+    }
+    // let the "g" replies close the ports
+    QTimer::singleShot(50, &loop, &QEventLoop::quit);
+    loop.exec();
+
+    // The same boards, one after another
+    SerialThread serialThread;
+    qint64 sequentialNs = 0;
+    for (BootloaderSimulator* simulator : simulators)
+    {
+        simulator->clearMemory();
+        const Result result = upload(&serialThread, simulator->portName(), baudRate, image);
+        sequentialNs += result.connectNs + result.sessionNs;
+        if (!result.ok || !simulator->memory(false).diffPages(image).isEmpty())
+            ++failures;
+    }
+    const double sequentialSeconds = sequentialNs / 1e9;
+
+    cout << "ports, I/O threads, size bytes, panel s, sequential s, speedup, failures" << endl;
+    cout << portCount << ", " << gang.threadCount() << ", " << image.size() << ", " << panelSeconds << ", "
+         << sequentialSeconds << ", " << (panelSeconds > 0 ? sequentialSeconds / panelSeconds : 0) << ", "
+         << failures << endl;
+    return failures ? 1 : 0;
+}
+
+// Connects at 9600 baud and programs from the connected() slot, runs times.
+// At this rate more than one probe is usually out when the banner arrives.
+int benchmarkHandshake(const QCommandLineParser& parser, int runs)
+{
+    const qint32 baudRate = 9600;
+    BootloaderSimulator simulator;
+    if (!startSimulator(simulator, parser, baudRate))
+        return 1;
+
+    Serial serial;
+    int probes = 0;
+    QObject::connect(&serial, &Serial::handshakeCompleted, [&probes](qint64, int count) { probes = count; });
+    const HexFile image = randomImage(1024);
+    cout << "run, probes, connect ms, upload s, verified" << endl;
+    int failures = 0;
+    for (int run = 1; run <= runs; ++run)
+    {
+        simulator.clearMemory();
+        probes = 0;
+        const Result result = upload(&serial, simulator.portName(), baudRate, image);
+        if (!result.ok)
+        {
+            ++failures;
+            cout << run << ", " << probes << ", failed: " << result.error.toLocal8Bit().constData() << endl;
+            continue;
+        }
+        const bool verified = simulator.memory(false).diffPages(image).isEmpty();
+        cout << run << ", " << probes << ", " << result.connectNs / 1e6 << ", " << result.uploadNs / 1e9 << ", "
+             << (verified ? "yes" : "NO") << endl;
+        if (!verified)
+            ++failures;
+    }
+    cout << runs - failures << " of " << runs << " runs programmed" << endl;
+    return failures ? 1 : 0;
+}
+
+// HexFile self checks on a random image
+int runChecks()
+{
+    QTemporaryDir dir;
+    const QString fileName = dir.filePath("check.hex");
+    if (!dir.isValid() || !writeHexfile(fileName, randomImage(70000)))
+        return 1;
+    const bool ok = HexFileTester().test(fileName);
+    cout << "HexFile checks " << (ok ? "passed" : "FAILED") << endl;
+    return ok ? 0 : 1;
+}
+
+// Uploads each of --sizes to a blank board; with --trace-overhead each size
+// again untraced, with --trace the last upload is exported
+int benchmarkSizes(const QCommandLineParser& parser)
+{
+    Bench bench(parser);
+    if (!bench.start(parser))
+        return 1;
+    BootloaderSimulator& simulator = bench.simulator();
+    const bool traceOverhead = parser.isSet("trace-overhead");
+
+    cout << "size bytes, connect ms, first byte us, upload s, payload bytes/s, ms/page, pages, verified"
+         << (traceOverhead ? ", untraced upload s, trace overhead %" : "") << endl;
+    int failures = 0;
+    for (const QString& sizeText : listOption(parser, "sizes"))
+    {
+        const HexFile image = randomImage(sizeText.toUInt());
+        // every size is verified against a blank device
+        simulator.clearMemory();
+        const int pagesBefore = simulator.pagesWritten();
+        const Result result = bench.upload(image);
+        const int pages = simulator.pagesWritten() - pagesBefore;
+        if (!result.ok)
+        {
+            ++failures;
+            cout << image.size() << ", failed: " << result.error.toLocal8Bit().constData() << endl;
+            continue;
+        }
+        const double seconds = result.uploadNs / 1e9;
+        const bool verified = simulator.memory(false).diffPages(image).isEmpty();
+        cout << image.size() << ", " << result.connectNs / 1e6 << ", " << result.firstByteNs / 1e3 << ", " << seconds << ", "
+             << qRound64(image.size() / seconds) << ", " << (pages ? seconds * 1000 / pages : 0) << ", "
+             << pages << ", " << (verified ? "yes" : "NO");
+        if (!verified)
+            ++failures;
+        if (traceOverhead)
+        {
+            bench.setTracing(false);
+            simulator.clearMemory();
+            const Result untraced = bench.upload(image);
+            bench.setTracing(true);
+            if (untraced.ok)
+                cout << ", " << untraced.uploadNs / 1e9 << ", " << (result.uploadNs - untraced.uploadNs) * 100.0 / untraced.uploadNs;
+            else
+            {
+                ++failures;
+                cout << ", failed: " << untraced.error.toLocal8Bit().constData();
+            }
+        }
+        cout << endl;
+    }
+
+    if (traceOverhead)
+    {
+        cout << "tracepoint cost:" << endl;
+        benchmarkTracepoint();
+    }
+
+    if (parser.isSet("trace"))
+    {
+        if (!bench.exportTrace(parser.value("trace")))
+            cerr << "Could not write " << parser.value("trace").toLocal8Bit().constData() << endl;
+        cout << "page latencies:" << endl << bench.pageLatencyReport().toLocal8Bit().constData();
+    }
+    return failures ? 1 : 0;
+}
+
+// Uploads the first size once per record length and compares
+int benchmarkRecordLengths(const QCommandLineParser& parser)
+{
+    Bench bench(parser);
+    if (!bench.start(parser))
+        return 1;
+    BootloaderSimulator& simulator = bench.simulator();
+    const HexFile image = firstSizeImage(parser);
+
+    cout << "record bytes, upload s, bytes received, payload bytes/s, verified" << endl;
+    int failures = 0;
+    for (const QString& lengthText : listOption(parser, "record-lengths"))
+    {
+        const int length = lengthText.toInt();
+        bench.setRecordLength(length);
+        simulator.clearMemory();
+        const qint64 bytesBefore = simulator.bytesReceived();
+        const Result result = bench.upload(image);
+        if (!result.ok)
+        {
+            ++failures;
+            cout << length << ", failed: " << result.error.toLocal8Bit().constData() << endl;
+            continue;
+        }
+        const double seconds = result.uploadNs / 1e9;
+        const bool verified = simulator.memory(false).diffPages(image).isEmpty();
+        cout << length << ", " << seconds << ", " << simulator.bytesReceived() - bytesBefore << ", "
+             << qRound64(image.size() / seconds) << ", " << (verified ? "yes" : "NO") << endl;
+        if (!verified)
+            ++failures;
+    }
+    return failures ? 1 : 0;
+}
+
+// Flash and EEPROM as one queued session against one session each
+int benchmarkSession(const QCommandLineParser& parser)
+{
+    Bench bench(parser);
+    if (!bench.start(parser))
+        return 1;
+    BootloaderSimulator& simulator = bench.simulator();
+    const HexFile flash = firstSizeImage(parser);
+    const HexFile eeprom = randomImage(1024);
+    const auto verified = [&]() {
+        return simulator.memory(false).diffPages(flash).isEmpty() && simulator.memory(true).diffPages(eeprom).isEmpty();
+    };
+    cout << "mode, connects, total s, verified" << endl;
+    int failures = 0;
+
+    simulator.clearMemory();
+    const Result queued = bench.run({Serial::Job::program(flash, true), Serial::Job::program(eeprom, false),
+                                     Serial::Job::startApplication()});
+    if (queued.ok)
+        cout << "queued, 1, " << (queued.connectNs + queued.sessionNs) / 1e9 << ", " << (verified() ? "yes" : "NO") << endl;
+    else
+        cout << "queued, failed: " << queued.error.toLocal8Bit().constData() << endl;
+    failures += !queued.ok || !verified();
+
+    simulator.clearMemory();
+    qint64 separateNs = 0;
+    bool separateOk = true;
+    for (bool doFlash : {true, false})
+    {
+        const Result result = bench.upload(doFlash ? flash : eeprom, doFlash);
+        separateNs += result.connectNs + result.sessionNs;
+        if (!result.ok)
+        {
+            separateOk = false;
+            cout << "separate, failed: " << result.error.toLocal8Bit().constData() << endl;
+            break;
+        }
+    }
+    if (separateOk)
+        cout << "separate, 2, " << separateNs / 1e9 << ", " << (verified() ? "yes" : "NO") << endl;
+    failures += !separateOk || !verified();
+    return failures ? 1 : 0;
+}
+
+void quietMessages(QtMsgType type, const QMessageLogContext&, const QString& msg)
+{
+    if (type != QtDebugMsg && type != QtInfoMsg)
+        cerr << msg.toLocal8Bit().constData() << endl;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Upload throughput against a simulated c45b2 bootloader");
+    parser.addHelpOption();
+    parser.addOptions({
+        {"baud", "Line rate of host and simulator.", "rate", "115200"},
+        {"sizes", "Comma separated image sizes in bytes.", "list", "4096,32768,131072"},
+        {"latency", "Page write time in microseconds.", "us", "4500"},
+        {"page-size", "Flash page size of the simulated device.", "bytes", "128"},
+        {"fail-at", "Reply '-' to this data record.", "record", "0"},
+        {"load", "Busy the main thread this many ms per 16 ms frame, like a flooded console.", "ms", "0"},
+        {"same-thread", "Run Serial on the main thread instead of its I/O thread."},
+        {"trace", "Write a Chrome trace of the last upload and print page latencies.", "file"},
+        {"trace-overhead", "Upload each size again with tracing off and compare."},
+        {"load-file", "Only time decoding this HEX file, old decoder against new.", "file"},
+        {"iterations", "Repetitions for --load-file.", "count", "20"},
+        {"check", "Only run the HexFile self checks."},
+        {"ports", "Program this many simulated boards at once with GangProgrammer, using the first size.", "count", "1"},
+        {"record-lengths", "Upload the first size once per record length in this list and compare.", "list"},
+        {"handshake-runs", "Connect at 9600 baud and program right away this many times.", "count", "0"},
+        {"session", "Program the first size and 1 KiB of EEPROM as one queued session and as two separate ones."},
+        {"gang-threads", "I/O threads for --ports, 0 for one per core.", "count", "0"},
+        {"verbose", "Show Qt debug output."},
+    });
+    parser.process(app);
+    if (!parser.isSet("verbose"))
+        qInstallMessageHandler(quietMessages);
+
+    if (parser.isSet("check"))
+        return runChecks();
+    if (parser.isSet("load-file"))
+    {
+        HexFileTester().benchmarkLoad(parser.value("load-file"), parser.value("iterations").toInt());
+        return 0;
+    }
+    if (parser.value("handshake-runs").toInt() > 0)
+        return benchmarkHandshake(parser, parser.value("handshake-runs").toInt());
+    if (parser.value("ports").toInt() > 1)
+        return benchmarkGang(parser, parser.value("ports").toInt(), firstSizeImage(parser));
+    if (parser.isSet("record-lengths"))
+        return benchmarkRecordLengths(parser);
+    if (parser.isSet("session"))
+        return benchmarkSession(parser);
+    return benchmarkSizes(parser);
+}
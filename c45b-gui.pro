@@ -21,20 +21,42 @@ DEFINES += QT_DEPRECATED_WARNINGS
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 SOURCES += \
+    cli.cpp \
+    common/hexencoder.cpp \
     common/hexfile.cpp \
     common/hexfiletester.cpp \
     common/hexutils.cpp \
+    common/imagecache.cpp \
+    common/log.cpp \
+    common/uploadtrace.cpp \
+    gangprogrammer.cpp \
+    linesender.cpp \
     main.cpp \
     mainwindow.cpp \
-    serial.cpp
+    portwatcher.cpp \
+    processstats.cpp \
+    progressmeter.cpp \
+    serial.cpp \
+    serialthread.cpp
 
 HEADERS += \
+    cli.h \
     commands.h \
+    common/hexencoder.h \
     common/hexfile.h \
     common/hexfiletester.h \
     common/hexutils.h \
+    common/imagecache.h \
+    common/log.h \
+    common/uploadtrace.h \
+    gangprogrammer.h \
+    linesender.h \
     mainwindow.h \
-    serial.h
+    portwatcher.h \
+    processstats.h \
+    progressmeter.h \
+    serial.h \
+    serialthread.h
 
 FORMS += \
     mainwindow.ui
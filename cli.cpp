@@ -0,0 +1,232 @@
+#include "cli.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTimer>
+
+#include "common/hexfile.h"
+#include "gangprogrammer.h"
+#include "processstats.h"
+#include "serial.h"
+
+namespace
+{
+
+// One JSON object per line on stdout
+void emitEvent(const QJsonObject &event)
+{
+    const QByteArray line = QJsonDocument(event).toJson(QJsonDocument::Compact);
+    fwrite(line.constData(), 1, line.size(), stdout);
+    fputc('\n', stdout);
+    fflush(stdout);
+}
+
+struct Job
+{
+    QString memory;
+    HexFile image;
+};
+
+// Several ports: the one image goes to every board through GangProgrammer
+int runGang(QCoreApplication &app, const QCommandLineParser &parser, const QStringList &ports, qint32 baudRate,
+            const Job &job)
+{
+    GangProgrammer gang;
+    int exitCode = CliOk;
+    QObject::connect(&gang, &GangProgrammer::portConnected, [](const QString &port, const QString &msg) {
+        emitEvent({{"event", "connected"}, {"port", port}, {"message", msg}});
+    });
+    QObject::connect(&gang, &GangProgrammer::portProgress, [&](const QString &port, int progress) {
+        emitEvent({{"event", "progress"}, {"port", port}, {"memory", job.memory}, {"percent", progress}});
+    });
+    QObject::connect(&gang, &GangProgrammer::portFinished, [&](const QString &port, bool ok, const QString &msg) {
+        if (ok)
+            emitEvent({{"event", "uploaded"}, {"port", port}, {"memory", job.memory}});
+        else
+            emitEvent({{"event", "error"}, {"port", port}, {"memory", job.memory},
+                       {"message", msg.isEmpty() ? QString("Upload failed") : msg}});
+    });
+    QObject::connect(&gang, &GangProgrammer::finished, [&](int succeeded, int failed) {
+        emitEvent({{"event", "done"}, {"succeeded", succeeded}, {"failed", failed}});
+        exitCode = failed ? CliUploadError : CliOk;
+        // give the "g" commands time to leave before the ports close
+        QTimer::singleShot(100, &app, &QCoreApplication::quit);
+    });
+
+    const bool doFlash = job.memory == "flash";
+    gang.start(ports, baudRate, job.image, doFlash, doFlash && parser.isSet("skip-erased"),
+               parser.value("timeout").toInt());
+    app.exec();
+    return exitCode;
+}
+
+}
+
+bool isCliInvocation(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--cli") == 0)
+            return true;
+    }
+    return false;
+}
+
+int runCli(int argc, char *argv[])
+{
+    QElapsedTimer startup;
+    startup.start();
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("c45b-gui");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Headless c45b2 programmer");
+    parser.addHelpOption();
+    parser.addOptions({
+        {"cli", "Run without a GUI."},
+        {"port", "Serial port, e.g. ttyUSB0; a comma separated list programs every board at once.", "name"},
+        {"baud", "Baud rate or 'auto'.", "rate", "auto"},
+        {"timeout", "Connection timeout in ms.", "ms", "2000"},
+        {"flash", "Flash image (.hex, .bin or .elf).", "file"},
+        {"eeprom", "EEPROM image (.eep, .hex, .bin or .elf).", "file"},
+        {"skip-erased", "Do not send flash pages that are entirely 0xFF."},
+        {"record-length", "Data bytes per hex record.", "bytes", "16"},
+        {"trace", "Write a Chrome trace of the session.", "file"},
+        {"stats", "Report startup time and peak memory."},
+    });
+    parser.process(app);
+
+    const QString port = parser.value("port");
+    if (port.isEmpty() || (!parser.isSet("flash") && !parser.isSet("eeprom")))
+    {
+        fprintf(stderr, "--port and at least one of --flash/--eeprom are required\n");
+        return CliUsage;
+    }
+    bool ok = true;
+    const qint32 baudRate = parser.value("baud") == "auto" ? Serial::AUTO_BAUD : parser.value("baud").toInt(&ok);
+    if (!ok || baudRate < 0)
+    {
+        fprintf(stderr, "Invalid baud rate '%s'\n", qPrintable(parser.value("baud")));
+        return CliUsage;
+    }
+
+    // Load everything before touching the port
+    QVector<Job> jobs;
+    for (const QString &memory : {QString("flash"), QString("eeprom")})
+    {
+        if (!parser.isSet(memory))
+            continue;
+        Job job;
+        job.memory = memory;
+        if (!job.image.loadImage(parser.value(memory), memory == "eeprom", false))
+        {
+            emitEvent({{"event", "error"}, {"memory", memory}, {"message", job.image.errorString()}});
+            return CliImageError;
+        }
+        jobs.append(job);
+    }
+
+    const QStringList ports = port.split(',');
+    if (ports.size() > 1)
+    {
+        if (jobs.size() > 1)
+        {
+            fprintf(stderr, "Several ports take either --flash or --eeprom, not both\n");
+            return CliUsage;
+        }
+        if (parser.isSet("stats"))
+            emitEvent(startupStats("cli", startup.nsecsElapsed()));
+        return runGang(app, parser, ports, baudRate, jobs.first());
+    }
+
+    // one session: every image, then 'g' straight after the last reply
+    const bool skipErased = parser.isSet("skip-erased");
+    QList<Serial::Job> session;
+    for (const Job &job : jobs)
+        session.append(Serial::Job::program(job.image, job.memory == "flash", skipErased && job.memory == "flash"));
+    session.append(Serial::Job::startApplication());
+
+    Serial serial;
+    serial.setRecordLength(parser.value("record-length").toInt());
+    int exitCode = CliOk;
+    int current = 0;
+    bool connecting = true;
+
+    auto finish = [&](int code) {
+        exitCode = code;
+        if (parser.isSet("trace"))
+            serial.trace().exportChromeTrace(parser.value("trace"));
+        // give the "g" command time to leave before the port closes
+        QTimer::singleShot(100, &app, &QCoreApplication::quit);
+    };
+
+    QObject::connect(&serial, &Serial::baudRateDetected, [](qint32 rate) {
+        emitEvent({{"event", "baud"}, {"rate", rate}});
+    });
+    qint64 handshakeNs = 0;
+    QObject::connect(&serial, &Serial::handshakeCompleted, [&](qint64 latencyNs, int) {
+        handshakeNs = latencyNs;
+    });
+    QObject::connect(&serial, &Serial::connected, [&](bool connected, const QString &msg) {
+        if (!connecting)
+            return;
+        connecting = false;
+        if (!connected)
+        {
+            emitEvent({{"event", "error"}, {"message", msg}});
+            finish(CliConnectError);
+            return;
+        }
+        emitEvent({{"event", "connected"}, {"port", port}, {"message", msg}, {"handshakeMs", handshakeNs / 1e6}});
+        serial.runJobs(session);
+    });
+    QObject::connect(&serial, &Serial::jobStarted, [&](int index, int) {
+        // the last job starts the application
+        if (index >= jobs.size())
+            return;
+        current = index;
+        const Job &job = jobs[current];
+        emitEvent({{"event", "program"}, {"memory", job.memory}, {"bytes", static_cast<int>(job.image.usedBytes())}});
+    });
+    QObject::connect(&serial, &Serial::uploadedProgress, [&](int progress, qint64 bytesPerSecond, qint64 etaMs) {
+        emitEvent({{"event", "progress"}, {"memory", jobs[current].memory}, {"percent", progress},
+                   {"bytesPerSecond", static_cast<double>(bytesPerSecond)}, {"etaMs", static_cast<double>(etaMs)}});
+    });
+    QObject::connect(&serial, &Serial::firmwareUploaded, [&](bool uploaded, const QString &msg) {
+        if (!uploaded)
+        {
+            emitEvent({{"event", "error"}, {"memory", jobs[current].memory},
+                       {"message", msg.isEmpty() ? QString("Upload failed") : msg}});
+            return;
+        }
+        emitEvent({{"event", "uploaded"}, {"memory", jobs[current].memory}});
+    });
+    QObject::connect(&serial, &Serial::jobsFinished, [&](bool ok) {
+        if (!ok)
+        {
+            serial.close();
+            finish(CliUploadError);
+            return;
+        }
+        emitEvent({{"event", "done"}});
+        finish(CliOk);
+    });
+
+    if (!serial.tryConnectToBootloader(port, baudRate, parser.value("timeout").toInt()))
+    {
+        emitEvent({{"event", "error"}, {"message", "Could not open port "+port}});
+        return CliConnectError;
+    }
+    if (parser.isSet("stats"))
+        emitEvent(startupStats("cli", startup.nsecsElapsed()));
+    app.exec();
+    if (parser.isSet("stats"))
+        emitEvent({{"event", "stats"}, {"mode", "cli"}, {"peakRssKiB", static_cast<double>(peakRssKiB())}});
+    return exitCode;
+}
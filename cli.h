@@ -0,0 +1,22 @@
+#ifndef CLI_H
+#define CLI_H
+
+// Exit codes of the headless programmer
+enum CliExitCode
+{
+    CliOk = 0,
+    CliUsage = 1,
+    CliImageError = 2,
+    CliConnectError = 3,
+    CliUploadError = 4,
+};
+
+// True if the command line asks for the headless programmer (--cli)
+bool isCliInvocation(int argc, char *argv[]);
+
+// QCoreApplication-only entry point: connect, program flash and/or EEPROM,
+// start the application and exit. Progress is printed as JSON lines. A
+// comma separated --port list programs one image into every board at once.
+int runCli(int argc, char *argv[]);
+
+#endif // CLI_H
@@ -0,0 +1,278 @@
+// This file is part of c45b.
+
+// c45b is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// c45b is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with c45b.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <cstring>
+
+#include <QIODevice>
+
+#include "hexencoder.h"
+#include "hexutils.h"
+
+const int HexEncoder::MAX_RECORD_LENGTH;
+
+const int HexEncoder::DEFAULT_RECORD_LENGTH;
+
+HexEncoder::HexEncoder(const HexFile& hexFile)
+    : m_hexFile(hexFile)
+{
+    rewind();
+}
+
+HexEncoder::HexEncoder(const FillRegion& fill)
+    : m_isFill(true), m_fill(fill)
+{
+    memset(m_fillData, fill.value, sizeof(m_fillData));
+    rewind();
+}
+
+void HexEncoder::rewind()
+{
+    m_segment = m_hexFile.segments().constBegin();
+    if (m_isFill)
+        m_address = m_fill.start;
+    else
+        m_address = m_segment != m_hexFile.segments().constEnd() ? m_segment.key() : 0;
+    m_currentSegment = 0;
+    m_lastCount = 0;
+    m_nextPage = 0;
+    m_pages = 0;
+    m_records = 0;
+    m_done = false;
+}
+
+int HexEncoder::next(char* out)
+{
+    return step(out);
+}
+
+int HexEncoder::step(char* out)
+{
+    // With out == nullptr only the length of the record is computed
+    const quint32 size = static_cast<quint32>(m_hexFile.size());
+    m_lastCount = 0;
+    for (;;)
+    {
+        quint32 start, end;
+        if (m_isFill)
+        {
+            start = m_fill.start;
+            end = m_fill.end;
+            if (m_address >= end)
+                break;
+        }
+        else
+        {
+            if (m_segment == m_hexFile.segments().constEnd())
+                break;
+            start = m_segment.key();
+            end = qMin(start + static_cast<quint32>(m_segment.value().size()), size);
+            if (m_address >= end)
+            {
+                ++m_segment;
+                if (m_segment != m_hexFile.segments().constEnd())
+                    m_address = m_segment.key();
+                continue;
+            }
+        }
+        // a fill repeats one record's worth of its value
+        const char* data = m_isFill ? m_fillData : m_segment.value().constData() + (m_address - start);
+
+        quint32 pageEnd = end;
+        if (m_skipPageSize)
+        {
+            pageEnd = qMin(m_address - m_address % m_skipPageSize + m_skipPageSize, end);
+            if ((m_address == start || m_address % m_skipPageSize == 0)
+                && (m_isFill ? m_fill.value == HexFile::FILL_BYTE
+                             : isFilled(data, pageEnd - m_address, HexFile::FILL_BYTE)))
+            {
+                m_address = pageEnd;
+                continue;
+            }
+        }
+
+        if ((m_address >> 16) != (m_currentSegment >> 12))
+        {
+            // extended segment address record
+            m_currentSegment = (m_address >> 16) << 12;
+            const char segment[2] = {char(m_currentSegment >> 8), char(m_currentSegment & 0xFF)};
+            return out ? encodeRecord(out, 0, 2, segment, 2) : 1 + 2*(5 + 2) + 1;
+        }
+
+        // records never straddle a 64k boundary
+        quint32 count = qMin(m_recordBytes, pageEnd - m_address);
+        count = qMin(count, 0x10000 - (m_address & 0xFFFF));
+        const quint16 address = m_address & 0xFFFF;
+        m_lastAddress = m_address;
+        m_lastCount = count;
+        m_address += count;
+        // records come in ascending address order
+        ++m_records;
+        const quint32 firstPage = qMax(m_lastAddress / m_pageSize, m_nextPage);
+        const quint32 lastPage = (m_address - 1) / m_pageSize;
+        if (lastPage >= firstPage)
+        {
+            m_pages += lastPage - firstPage + 1;
+            m_nextPage = lastPage + 1;
+        }
+        return out ? encodeRecord(out, address, 0, data, count) : 1 + 2*(5 + count) + 1;
+    }
+
+    if (m_done)
+        return 0;
+    m_done = true;
+    static const char endOfFile[] = ":00000001FF\n";
+    if (out)
+        memcpy(out, endOfFile, sizeof(endOfFile) - 1);
+    return sizeof(endOfFile) - 1;
+}
+
+int HexEncoder::encodeRecord(char* out, quint16 address, quint8 type, const char* data, int count)
+{
+    char* p = out;
+    quint8 checksum = count + (address >> 8) + (address & 0xFF) + type;
+    *p++ = ':';
+    *p++ = HEX_DIGITS[(count >> 4) & 0x0F];
+    *p++ = HEX_DIGITS[count & 0x0F];
+    *p++ = HEX_DIGITS[address >> 12];
+    *p++ = HEX_DIGITS[(address >> 8) & 0x0F];
+    *p++ = HEX_DIGITS[(address >> 4) & 0x0F];
+    *p++ = HEX_DIGITS[address & 0x0F];
+    *p++ = HEX_DIGITS[type >> 4];
+    *p++ = HEX_DIGITS[type & 0x0F];
+    for (int i = 0; i < count; ++i)
+    {
+        const quint8 byte = data[i];
+        checksum += byte;
+        *p++ = HEX_DIGITS[byte >> 4];
+        *p++ = HEX_DIGITS[byte & 0x0F];
+    }
+    checksum = (checksum ^ 0xFF)+1;
+    *p++ = HEX_DIGITS[checksum >> 4];
+    *p++ = HEX_DIGITS[checksum & 0x0F];
+    *p++ = '\n';
+    return static_cast<int>(p - out);
+}
+
+qint64 HexEncoder::encodedSize() const
+{
+    HexEncoder encoder(*this);
+    encoder.rewind();
+    qint64 result = 0;
+    while (int length = encoder.step(nullptr))
+        result += length;
+    return result;
+}
+
+int HexEncoder::pageCount(quint32 pageSize) const
+{
+    HexEncoder encoder(*this);
+    encoder.setPageSize(pageSize);
+    encoder.rewind();
+    while (encoder.step(nullptr)) {}
+    return encoder.pagesSoFar();
+}
+
+int HexEncoder::recordCount() const
+{
+    HexEncoder encoder(*this);
+    encoder.rewind();
+    while (encoder.step(nullptr)) {}
+    return encoder.recordsSoFar();
+}
+
+template<typename Function>
+void HexEncoder::forEachRange(Function function) const
+{
+    if (m_isFill)
+    {
+        if (m_fill.end > m_fill.start)
+            function(m_fill.start, m_fill.end - m_fill.start);
+        return;
+    }
+    const HexFile::SegmentMap& segments = m_hexFile.segments();
+    for (HexFile::SegmentMap::const_iterator it = segments.constBegin(); it != segments.constEnd(); ++it)
+        function(it.key(), static_cast<quint32>(it.value().size()));
+}
+
+int HexEncoder::pageBound(quint32 pageSize) const
+{
+    pageSize = qMax<quint32>(pageSize, 1);
+    qint64 result = 0;
+    forEachRange([&result, pageSize](quint32 start, quint32 length) {
+        result += (start + length - 1) / pageSize - start / pageSize + 1;
+    });
+    return static_cast<int>(result);
+}
+
+int HexEncoder::recordBound() const
+{
+    // records end at the record length, at 64k boundaries and, when skipping
+    // erased pages, at page boundaries
+    qint64 result = 0;
+    const quint32 recordBytes = m_recordBytes;
+    const quint32 skipPageSize = m_skipPageSize;
+    forEachRange([&result, recordBytes, skipPageSize](quint32, quint32 length) {
+        result += (length + recordBytes - 1) / recordBytes + length / 0x10000 + 1;
+        if (skipPageSize)
+            result += length / skipPageSize + 1;
+    });
+    return static_cast<int>(result);
+}
+
+qint64 HexEncoder::sizeBound() const
+{
+    // every data byte takes two digits, every record 12 bytes of framing;
+    // plus one extended segment record per 64k and the end of file record
+    qint64 dataBytes = 0;
+    qint64 segmentRecords = 0;
+    forEachRange([&dataBytes, &segmentRecords](quint32, quint32 length) {
+        dataBytes += length;
+        segmentRecords += length / 0x10000 + 1;
+    });
+    return 2 * dataBytes + 12 * qint64(recordBound()) + 16 * segmentRecords + 12;
+}
+
+QByteArray HexEncoder::toByteArray() const
+{
+    QByteArray result;
+    result.resize(static_cast<int>(encodedSize()));
+    char* out = result.data();
+    HexEncoder encoder(*this);
+    encoder.rewind();
+    while (int length = encoder.next(out))
+        out += length;
+    return result;
+}
+
+bool HexEncoder::writeTo(QIODevice* device) const
+{
+    // Batch records so the device sees few large writes
+    char buffer[16384];
+    int used = 0;
+    HexEncoder encoder(*this);
+    encoder.rewind();
+    for (;;)
+    {
+        if (used > static_cast<int>(sizeof(buffer)) - MAX_RECORD_LENGTH || encoder.atEnd())
+        {
+            if (used > 0 && device->write(buffer, used) != used)
+                return false;
+            used = 0;
+            if (encoder.atEnd())
+                return true;
+        }
+        used += encoder.next(buffer + used);
+    }
+}
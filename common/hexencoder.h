@@ -0,0 +1,127 @@
+// This file is part of c45b.
+
+// c45b is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// c45b is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with c45b.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEXENCODER_H
+#define HEXENCODER_H
+
+#include <QByteArray>
+
+#include "hexfile.h"
+
+class QIODevice;
+
+// Address range [start, end) in which every byte has the same value, e.g.
+// an erase job. Encoded without ever materialising the bytes.
+struct FillRegion
+{
+    quint32 start;
+    quint32 end;
+    quint8 value;
+};
+
+// Produces the Intel HEX records of a HexFile one at a time, formatting each
+// straight into a caller supplied buffer. No per-record allocations are made.
+class HexEncoder
+{
+public:
+    // Longest possible record: ':', 5+255 bytes as hex digits and '\n'
+    static const int MAX_RECORD_LENGTH = 1 + 2*(5 + 255) + 1;
+
+    // Data bytes per record unless setRecordLength() says otherwise
+    static const int DEFAULT_RECORD_LENGTH = 16;
+
+    explicit HexEncoder(const HexFile& hexFile);
+    explicit HexEncoder(const FillRegion& fill);
+
+    // Writes the next record to out (at least MAX_RECORD_LENGTH bytes) and
+    // returns its length. Returns 0 after the end-of-file record.
+    int next(char* out);
+
+    bool atEnd() const {return m_done;}
+    void rewind();
+
+    // Leave out pages of pageSize bytes that are entirely FILL_BYTE; 0 emits
+    // every stored byte. On the device such pages keep what they held before.
+    void setSkipErasedPages(quint32 pageSize) {m_skipPageSize = pageSize;}
+
+    // Data bytes per record, 1 to 255. Longer records spend a smaller share
+    // of the line on framing; the bootloader must accept the length.
+    void setRecordLength(int bytes) {m_recordBytes = static_cast<quint32>(qBound(1, bytes, 255));}
+    int recordLength() const {return static_cast<int>(m_recordBytes);}
+
+    // Number of pages of pageSize bytes touched by the data records
+    int pageCount(quint32 pageSize) const;
+    // Number of data records
+    int recordCount() const;
+
+    // The same counts for the records next() has produced since rewind(),
+    // so a streaming caller learns the totals without a second pass.
+    // Pages are counted in units of setPageSize(), HexFile::PAGE_SIZE by default.
+    void setPageSize(quint32 pageSize) {m_pageSize = qMax<quint32>(pageSize, 1);}
+    int pagesSoFar() const {return m_pages;}
+    int recordsSoFar() const {return m_records;}
+
+    // Upper bounds of pageCount(), recordCount() and encodedSize(), computed
+    // from the segment sizes alone without encoding anything
+    int pageBound(quint32 pageSize) const;
+    int recordBound() const;
+    qint64 sizeBound() const;
+
+    // Exact number of bytes the complete encoding takes
+    qint64 encodedSize() const;
+
+    // Encodes the whole image into a single preallocated buffer
+    QByteArray toByteArray() const;
+
+    bool writeTo(QIODevice* device) const;
+
+    // Calls sink(const char* record, int length) for every record
+    template<typename Sink>
+    void forEach(Sink sink) const
+    {
+        HexEncoder encoder(*this);
+        encoder.rewind();
+        char record[MAX_RECORD_LENGTH];
+        while (int length = encoder.next(record))
+            sink(static_cast<const char*>(record), length);
+    }
+
+    static int encodeRecord(char* out, quint16 address, quint8 type, const char* data, int count);
+
+private:
+    int step(char* out);
+    // Calls function(start, length) for the fill region or every segment
+    template<typename Function>
+    void forEachRange(Function function) const;
+
+    HexFile m_hexFile;
+    bool m_isFill = false;
+    FillRegion m_fill = FillRegion();
+    char m_fillData[255];
+    HexFile::SegmentMap::const_iterator m_segment;
+    quint32 m_address;
+    quint32 m_currentSegment;
+    quint32 m_skipPageSize = 0;
+    quint32 m_recordBytes = DEFAULT_RECORD_LENGTH;
+    quint32 m_lastAddress = 0;
+    quint32 m_lastCount = 0;
+    quint32 m_pageSize = HexFile::PAGE_SIZE;
+    quint32 m_nextPage = 0;
+    int m_pages = 0;
+    int m_records = 0;
+    bool m_done;
+};
+
+#endif
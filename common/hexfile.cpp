@@ -17,8 +17,18 @@
 
 #include <iostream>
 #include <iomanip>
+#include <iterator>
+#include <sstream>
+#include <cstring>
 
+#include <functional>
+
+#include <QDataStream>
 #include <QFile>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
+#include <QVector>
 
 #include "hexfile.h"
 #include "hexutils.h"
@@ -29,8 +39,15 @@ using namespace std;
 // Currently the biggest AVR controller has 256k Flash
 const quint32 MAX_FLASH_BYTES = 262144;
 
+// Files at least this big are decoded on the thread pool by default
+const qint64 PARALLEL_LOAD_THRESHOLD = 1024 * 1024;
+
+const quint32 HexFile::PAGE_SIZE;
+const quint8 HexFile::FILL_BYTE;
+
 
 HexFile::HexFile()
+    : m_size(0)
 {
     reset();
 }
@@ -39,90 +56,507 @@ HexFile::~HexFile()
 {
 }
 
-bool HexFile::load(QString fileName, bool verbose)
+namespace
 {
-    QFile f(fileName);
-    if (!f.open(QIODevice::ReadOnly | QIODevice::Text))
+
+// Decodes the Intel HEX records in [begin, end). lineNr is the number of the
+// first line and extendedSegmentAddress the segment in effect at begin. Data
+// records are handed to store(address, data, count). Verbose messages go to
+// log unless it is null.
+template<typename Store>
+bool decodeRecords(const char* begin, const char* end, quint32 lineNr, quint32 extendedSegmentAddress,
+                   ostream* log, QString* error, Store store)
+{
+    // byte count, address high/low, record type, up to 255 data bytes, checksum
+    quint8 record[5 + 255];
+
+    for (const char* line = begin; line < end; ++lineNr)
     {
-        m_lastError = "File not found";
-        return false;
-    }
-    reset();
-    quint16 lineNr = 0;
-    quint32 extendedSegmentAddress = 0;
-    while (!f.atEnd())
-    {
-        ++lineNr;
-        QByteArray line = f.readLine();
-
-        // grab hexfile information
-        unsigned char byteCount = asciiToHex(line[1], line[2]);  // get number of bytes
-        unsigned char checkSum = byteCount;  // start checksum computation
-        quint32 address = asciiToHex(line[3], line[4]);  // get address high byte
-        checkSum += (unsigned char) address;  // checksum...
-        address = address << 8;
-        unsigned char low = asciiToHex(line[5], line[6]);  // get address low byte
-        address += low;
-        checkSum += (unsigned char) (address & 0xff);  // checksum...
-        unsigned char recordType = asciiToHex(line[7], line[8]);  // get record type
-        checkSum += recordType;
-        unsigned char fileCheckSum = asciiToHex(line[(byteCount*2)+9], line[(byteCount*2)+10]);  // get the checksum
+        const char* eol = static_cast<const char*>(memchr(line, '\n', end - line));
+        if (!eol)
+            eol = end;
+        const char* next = eol + 1;
+        while (eol > line && (eol[-1] == '\r' || eol[-1] == ' ' || eol[-1] == '\t'))
+            --eol;
+        if (eol == line)
+        {
+            // tolerate blank lines
+            line = next;
+            continue;
+        }
+
+        if (*line != ':' || eol - line < 11 || ((eol - line - 1) & 1))
+        {
+            *error = QString("Malformed record in line %1").arg(lineNr);
+            return false;
+        }
+        const unsigned char* hex = reinterpret_cast<const unsigned char*>(line + 1);
+        if ((HEX_NIBBLE[hex[0]] | HEX_NIBBLE[hex[1]]) & HEX_INVALID)
+        {
+            *error = QString("Invalid character in line %1").arg(lineNr);
+            return false;
+        }
+        const quint32 recordBytes = 5 + ((HEX_NIBBLE[hex[0]] << 4) | HEX_NIBBLE[hex[1]]);
+        if (static_cast<quint32>(eol - line - 1) != 2 * recordBytes)
+        {
+            *error = QString("Record length mismatch in line %1").arg(lineNr);
+            return false;
+        }
+
+        // decode the whole record, validating digits and summing in one pass
+        unsigned char invalid = 0;
+        unsigned char checkSum = 0;
+        for (quint32 i = 0; i < recordBytes; ++i)
+        {
+            const unsigned char high = HEX_NIBBLE[hex[2*i]];
+            const unsigned char low = HEX_NIBBLE[hex[2*i + 1]];
+            invalid |= high | low;
+            record[i] = (high << 4) | (low & 0x0F);
+            checkSum += record[i];
+        }
+        if (invalid & HEX_INVALID)
+        {
+            *error = QString("Invalid character in line %1").arg(lineNr);
+            return false;
+        }
+
+        const unsigned char byteCount = record[0];
+        const quint32 address = (record[1] << 8) | record[2];
+        const unsigned char recordType = record[3];
+        const unsigned char fileCheckSum = record[recordBytes - 1];
+
+        // check if checksum error
+        if (checkSum != 0)
+        {
+            const unsigned char computed = checkSum - fileCheckSum;
+            *error = QString("Checksum error in line %1: Expected %2, computed %3").arg(lineNr).arg(fileCheckSum).arg(computed);
+            return false;
+        }
 
         switch (recordType)
         {
         case 2:
             // extended segment address record
-            extendedSegmentAddress = asciiToHex(line[9], line[10]) << 8;
-            checkSum += (extendedSegmentAddress >> 8);  // chechsum...
-            extendedSegmentAddress += asciiToHex(line[11], line[12]);
-            checkSum += (extendedSegmentAddress & 0xff);  // chechsum...
-            if(verbose)
+            if (byteCount != 2)
             {
-                cout << "Got extended adress record" <<endl;
+                *error = QString("Malformed extended segment address record in line %1").arg(lineNr);
+                return false;
+            }
+            extendedSegmentAddress = (record[4] << 8) | record[5];
+            if (log)
+            {
+                *log << "Got extended adress record" << endl;
             }
             break;
 
         case 1:
             // end of file record
-            if (verbose)
+            if (log)
             {
-                cout << "Loaded hex file" << endl;
-                cout << "Read " << QByteArray::size() << " bytes" << endl;
+                *log << "Loaded hex file" << endl;
             }
             break;
 
         case 0:
+            // data record
+            if (!store(address + (extendedSegmentAddress * 16), record + 4, byteCount))
             {
-                // data record
-                for (unsigned int i = 0; i < (2 * ((unsigned int)byteCount)); i += 2)
-                {
-                    unsigned char dataByte = asciiToHex(line[i+9], line[i+10]);
-                    checkSum += dataByte;  // compute checksum
-                    if(!setByte(address + (extendedSegmentAddress * 16) + (i >> 1), dataByte))
-                    {
-                        m_lastError = QString("Maximum size exceeded");
-                        return false;
-                    }
-                }
-
+                *error = QString("Maximum size exceeded");
+                return false;
             }
             break;
+
         default:
-            m_lastError = QString("Found unknown or unsupported record type (0x%1)").arg(recordType, 2, 16, QChar('0'));
+            *error = QString("Found unknown or unsupported record type (0x%1)").arg(recordType, 2, 16, QChar('0'));
             return false;
         }
 
-        // check if checksum error
-        if (((checkSum + fileCheckSum) & 0xff) != 0)
+        line = next;
+    }
+
+    return true;
+}
+
+// Result of decoding one chunk of a file on the thread pool
+struct Chunk
+{
+    struct Run
+    {
+        quint32 address;
+        int offset;
+        int length;
+    };
+
+    const char* begin;
+    const char* end;
+    quint32 lines;
+    bool hasSegmentRecord;
+    quint32 lastSegment;
+    quint32 firstLine;
+    quint32 segment;
+
+    bool ok;
+    QString error;
+    QByteArray data;
+    QVector<Run> runs;
+    // verbose output, printed in file order once all chunks are done
+    std::string log;
+};
+
+// Counts the lines of a chunk and picks up its last extended segment record
+void scanChunk(Chunk& chunk)
+{
+    chunk.lines = 0;
+    chunk.hasSegmentRecord = false;
+    for (const char* line = chunk.begin; line < chunk.end; ++chunk.lines)
+    {
+        const char* eol = static_cast<const char*>(memchr(line, '\n', chunk.end - line));
+        if (!eol)
+            eol = chunk.end;
+        if (eol - line >= 13 && line[0] == ':' && line[7] == '0' && line[8] == '2')
         {
-            m_lastError = QString("Checksum error in line %1: Expected %2, computed %3").arg(lineNr).arg(fileCheckSum).arg(checkSum);
+            const unsigned char* hex = reinterpret_cast<const unsigned char*>(line + 9);
+            chunk.hasSegmentRecord = true;
+            chunk.lastSegment = (asciiToHex(hex[0], hex[1]) << 8) | asciiToHex(hex[2], hex[3]);
+        }
+        line = eol + 1;
+    }
+}
+
+void decodeChunk(Chunk& chunk, bool verbose)
+{
+    chunk.data.reserve(static_cast<int>((chunk.end - chunk.begin) / 2));
+    ostringstream log;
+    chunk.ok = decodeRecords(chunk.begin, chunk.end, chunk.firstLine, chunk.segment, verbose ? &log : nullptr, &chunk.error,
+                             [&chunk](quint32 address, const quint8* data, quint32 count)
+    {
+        if (address + count > MAX_FLASH_BYTES)
+            return false;
+        if (!chunk.runs.isEmpty()
+            && chunk.runs.last().address + chunk.runs.last().length == address)
+            chunk.runs.last().length += count;
+        else
+            chunk.runs.append({address, chunk.data.size(), static_cast<int>(count)});
+        chunk.data.append(reinterpret_cast<const char*>(data), count);
+        return true;
+    });
+    chunk.log = log.str();
+}
+
+class FunctionRunnable : public QRunnable
+{
+public:
+    FunctionRunnable(const std::function<void()>& function, QSemaphore* done)
+        : m_function(function), m_done(done) {}
+
+    void run() override
+    {
+        m_function();
+        m_done->release();
+    }
+
+private:
+    std::function<void()> m_function;
+    QSemaphore* m_done;
+};
+
+// load() blocks until its chunks are decoded. On the global pool that could
+// deadlock when load() itself runs on a global pool thread, so decoding has
+// a pool of its own that only ever runs chunk tasks.
+QThreadPool* decodePool()
+{
+    static QThreadPool pool;
+    return &pool;
+}
+
+// Runs function(i) for 0 <= i < count on the decode pool and waits
+void runOnPool(int count, const std::function<void(int)>& function)
+{
+    QSemaphore done;
+    for (int i = 0; i < count; ++i)
+        decodePool()->start(new FunctionRunnable([&function, i]() { function(i); }, &done));
+    done.acquire(count);
+}
+
+// Decode straight out of the page cache; fall back to a single read for
+// devices that cannot be mapped
+void mapContents(QFile& f, QByteArray& contents, const char** begin, const char** end)
+{
+    const qint64 fileSize = f.size();
+    const uchar* mapped = fileSize > 0 ? f.map(0, fileSize) : nullptr;
+    if (mapped)
+    {
+        *begin = reinterpret_cast<const char*>(mapped);
+        *end = *begin + fileSize;
+        return;
+    }
+    contents = f.readAll();
+    *begin = contents.constData();
+    *end = *begin + contents.size();
+}
+
+quint16 readLe16(const char* p)
+{
+    const uchar* u = reinterpret_cast<const uchar*>(p);
+    return u[0] | (u[1] << 8);
+}
+
+quint32 readLe32(const char* p)
+{
+    const uchar* u = reinterpret_cast<const uchar*>(p);
+    return u[0] | (u[1] << 8) | (u[2] << 16) | (quint32(u[3]) << 24);
+}
+
+const quint16 EM_AVR = 83;
+
+// avr-gcc places flash at 0, SRAM at 0x800000 and EEPROM at 0x810000
+const quint32 AVR_SRAM_OFFSET = 0x800000;
+const quint32 AVR_EEPROM_OFFSET = 0x810000;
+const quint32 AVR_EEPROM_END = 0x820000;
+
+}
+
+bool HexFile::loadImage(QString fileName, bool eeprom, bool verbose)
+{
+    QFile f(fileName);
+    if (f.open(QIODevice::ReadOnly))
+    {
+        char magic[4];
+        if (f.read(magic, 4) == 4 && memcmp(magic, "\177ELF", 4) == 0)
+            return loadElf(fileName, eeprom, verbose);
+    }
+    if (fileName.endsWith(".bin", Qt::CaseInsensitive))
+        return loadBinary(fileName, 0, verbose);
+    return load(fileName, verbose);
+}
+
+bool HexFile::loadBinary(QString fileName, quint32 baseAddress, bool verbose)
+{
+    QFile f(fileName);
+    if (!f.open(QIODevice::ReadOnly))
+    {
+        m_lastError = "File not found";
+        return false;
+    }
+    reset();
+
+    QByteArray contents;
+    const char* begin;
+    const char* end;
+    mapContents(f, contents, &begin, &end);
+    if (!setBytes(baseAddress, reinterpret_cast<const quint8*>(begin), static_cast<quint32>(end - begin)))
+    {
+        m_lastError = QString("Maximum size exceeded");
+        return false;
+    }
+    if (verbose)
+    {
+        cout << "Loaded binary file" << endl;
+        cout << "Read " << m_size << " bytes (" << usedBytes() << " stored)" << endl;
+    }
+    return true;
+}
+
+bool HexFile::loadElf(QString fileName, bool eeprom, bool verbose)
+{
+    QFile f(fileName);
+    if (!f.open(QIODevice::ReadOnly))
+    {
+        m_lastError = "File not found";
+        return false;
+    }
+    reset();
+
+    QByteArray contents;
+    const char* begin;
+    const char* end;
+    mapContents(f, contents, &begin, &end);
+    const quint32 fileSize = static_cast<quint32>(end - begin);
+
+    // ELF32 header: e_ident[16], e_type, e_machine, e_version, e_entry,
+    // e_phoff (28), e_shoff, e_flags, e_ehsize, e_phentsize (42), e_phnum (44)
+    if (fileSize < 52 || memcmp(begin, "\177ELF", 4) != 0)
+    {
+        m_lastError = "Not an ELF file";
+        return false;
+    }
+    if (begin[4] != 1 || begin[5] != 1)
+    {
+        m_lastError = "Only 32 bit little endian ELF files are supported";
+        return false;
+    }
+    const quint16 machine = readLe16(begin + 18);
+    if (machine != EM_AVR)
+    {
+        m_lastError = QString("Not an AVR ELF file (machine %1)").arg(machine);
+        return false;
+    }
+    const quint32 phoff = readLe32(begin + 28);
+    const quint16 phentsize = readLe16(begin + 42);
+    const quint16 phnum = readLe16(begin + 44);
+    if (phnum == 0 || phentsize < 32 || phoff > fileSize || quint64(phnum) * phentsize > fileSize - phoff)
+    {
+        m_lastError = "ELF file has no loadable segments";
+        return false;
+    }
+
+    // Program headers cover .text, .data (at its load address in flash) and
+    // .eeprom; the payload is copied straight out of the mapping
+    for (quint16 i = 0; i < phnum; ++i)
+    {
+        const char* ph = begin + phoff + quint32(i) * phentsize;
+        const quint32 type = readLe32(ph);
+        const quint32 offset = readLe32(ph + 4);
+        const quint32 paddr = readLe32(ph + 12);
+        const quint32 filesz = readLe32(ph + 16);
+        if (type != 1 || filesz == 0)  // PT_LOAD
+            continue;
+        if (offset > fileSize || filesz > fileSize - offset)
+        {
+            m_lastError = QString("Truncated ELF segment %1").arg(i);
             return false;
         }
+
+        quint32 address;
+        if (eeprom && paddr >= AVR_EEPROM_OFFSET && paddr < AVR_EEPROM_END)
+            address = paddr - AVR_EEPROM_OFFSET;
+        else if (!eeprom && paddr < AVR_SRAM_OFFSET)
+            address = paddr;
+        else
+            continue;
+        if (!setBytes(address, reinterpret_cast<const quint8*>(begin + offset), filesz))
+        {
+            m_lastError = QString("Maximum size exceeded");
+            return false;
+        }
+        if (verbose)
+        {
+            cout << "Loaded ELF segment at 0x" << hex << paddr << dec << " (" << filesz << " bytes)" << endl;
+        }
+    }
+    if (verbose)
+    {
+        cout << "Read " << m_size << " bytes (" << usedBytes() << " stored)" << endl;
     }
+    return true;
+}
 
+bool HexFile::load(QString fileName, bool verbose, int threads)
+{
+    QFile f(fileName);
+    if (!f.open(QIODevice::ReadOnly))
+    {
+        m_lastError = "File not found";
+        return false;
+    }
+    reset();
+
+    QByteArray contents;
+    const char* begin;
+    const char* end;
+    mapContents(f, contents, &begin, &end);
+
+    if (threads <= 0)
+        threads = (end - begin) >= PARALLEL_LOAD_THRESHOLD ? decodePool()->maxThreadCount() : 1;
+    const bool ok = threads > 1
+        ? decodeParallel(begin, end, threads, verbose)
+        : decodeRecords(begin, end, 1, 0, verbose ? &cout : nullptr, &m_lastError,
+                        [this](quint32 address, const quint8* data, quint32 count)
+                        { return setBytes(address, data, count); });
+    if (ok && verbose)
+    {
+        cout << "Read " << m_size << " bytes (" << usedBytes() << " stored)" << endl;
+    }
+    return ok;
+}
+
+bool HexFile::decodeParallel(const char* begin, const char* end, int chunkCount, bool verbose)
+{
+    // Split on record boundaries
+    QVector<Chunk> chunks;
+    const qint64 length = end - begin;
+    const char* chunkBegin = begin;
+    for (int i = 1; i <= chunkCount && chunkBegin < end; ++i)
+    {
+        const char* chunkEnd = end;
+        if (i < chunkCount)
+        {
+            const char* split = qMax(chunkBegin, begin + length * i / chunkCount);
+            const char* eol = static_cast<const char*>(memchr(split, '\n', end - split));
+            chunkEnd = eol ? eol + 1 : end;
+        }
+        Chunk chunk = Chunk();
+        chunk.begin = chunkBegin;
+        chunk.end = chunkEnd;
+        chunks.append(chunk);
+        chunkBegin = chunkEnd;
+    }
+
+    // Line numbers and segment state at the start of each chunk
+    runOnPool(chunks.size(), [&chunks](int i) { scanChunk(chunks[i]); });
+    quint32 line = 1;
+    quint32 segment = 0;
+    for (Chunk& chunk : chunks)
+    {
+        chunk.firstLine = line;
+        chunk.segment = segment;
+        line += chunk.lines;
+        if (chunk.hasSegmentRecord)
+            segment = chunk.lastSegment;
+    }
+
+    runOnPool(chunks.size(), [&chunks, verbose](int i) { decodeChunk(chunks[i], verbose); });
+
+    // Merge in file order so later records win and the messages come out
+    // exactly like on the serial path
+    for (const Chunk& chunk : chunks)
+    {
+        cout << chunk.log;
+        if (!chunk.ok)
+        {
+            m_lastError = chunk.error;
+            return false;
+        }
+        for (const Chunk::Run& run : chunk.runs)
+            setBytes(run.address, reinterpret_cast<const quint8*>(chunk.data.constData()) + run.offset, run.length);
+    }
     return true;
 }
 
+char* HexFile::writable(quint32 address, quint32* available)
+{
+    const quint32 page = address & ~(PAGE_SIZE - 1);
+    SegmentMap::iterator next = m_segments.upperBound(address);
+    SegmentMap::iterator seg = m_segments.end();
+    if (next != m_segments.begin())
+    {
+        SegmentMap::iterator prev = std::prev(next);
+        const quint32 end = prev.key() + static_cast<quint32>(prev.value().size());
+        if (address < end)
+            seg = prev;
+        else if (end == page)
+        {
+            // grow the preceding segment by one page
+            prev.value().append(QByteArray(PAGE_SIZE, char(FILL_BYTE)));
+            seg = prev;
+        }
+    }
+    if (seg == m_segments.end())
+        seg = m_segments.insert(page, QByteArray(PAGE_SIZE, char(FILL_BYTE)));
+
+    // keep segments maximal: swallow the following one if it is now adjacent
+    next = std::next(seg);
+    if (next != m_segments.end() && next.key() == seg.key() + static_cast<quint32>(seg.value().size()))
+    {
+        seg.value().append(next.value());
+        m_segments.erase(next);
+    }
+
+    const quint32 offset = address - seg.key();
+    *available = static_cast<quint32>(seg.value().size()) - offset;
+    return seg.value().data() + offset;
+}
+
 bool HexFile::setByte(quint32 address, quint8 data)
 {
     if (address >= MAX_FLASH_BYTES)
@@ -130,85 +564,242 @@ bool HexFile::setByte(quint32 address, quint8 data)
         m_lastError = QString("Overflow (address %1)").arg(address);
         return false;
     }
-    if (address > static_cast<quint32>(QByteArray::size()))
-        QByteArray::append(QByteArray(address - QByteArray::size(), 0));
-    QByteArray::operator[](address) = data;
+
+    quint32 available;
+    *writable(address, &available) = data;
+    if (address >= m_size)
+        m_size = address + 1;
     return true;
 }
 
-bool HexFile::append(quint8 data)
+bool HexFile::setBytes(quint32 address, const quint8* data, quint32 count)
 {
-    if (static_cast<quint32>(QByteArray::length()) >= MAX_FLASH_BYTES)
+    if (address + count > MAX_FLASH_BYTES)
     {
-        m_lastError = QString("Overflow (address %1)").arg(QByteArray::length()+1);
+        m_lastError = QString("Overflow (address %1)").arg(qMax(address, MAX_FLASH_BYTES));
         return false;
     }
-    QByteArray::append(data);
+
+    const quint32 end = address + count;
+    while (address < end)
+    {
+        quint32 available;
+        char* dest = writable(address, &available);
+        const quint32 n = qMin(available, end - address);
+        memcpy(dest, data, n);
+        data += n;
+        address += n;
+    }
+    if (end > m_size)
+        m_size = end;
     return true;
 }
 
+bool HexFile::append(quint8 data)
+{
+    if (m_size >= MAX_FLASH_BYTES)
+    {
+        m_lastError = QString("Overflow (address %1)").arg(m_size+1);
+        return false;
+    }
+    return setByte(m_size, data);
+}
+
 void HexFile::reset()
 {
-    QByteArray::fill(0, MAX_FLASH_BYTES);
-    QByteArray::clear();
+    m_segments.clear();
+    m_size = 0;
+}
+
+quint32 HexFile::usedBytes() const
+{
+    quint32 result = 0;
+    for (SegmentMap::const_iterator it = m_segments.constBegin(); it != m_segments.constEnd(); ++it)
+        result += static_cast<quint32>(it.value().size());
+    return result;
 }
 
-bool HexFile::equal(const HexFile& other)
+bool HexFile::isSet(quint32 address) const
 {
-    if (size() != other.size())
+    SegmentMap::const_iterator next = m_segments.upperBound(address);
+    if (next == m_segments.constBegin())
         return false;
+    SegmentMap::const_iterator seg = std::prev(next);
+    return address < seg.key() + static_cast<quint32>(seg.value().size());
+}
 
-    for (int i = 0; i < size(); ++i)
-        if (operator[](i) != other[i])
-            return false;
-    return true;
+quint8 HexFile::at(quint32 address) const
+{
+    SegmentMap::const_iterator next = m_segments.upperBound(address);
+    if (next == m_segments.constBegin())
+        return FILL_BYTE;
+    SegmentMap::const_iterator seg = std::prev(next);
+    if (address >= seg.key() + static_cast<quint32>(seg.value().size()))
+        return FILL_BYTE;
+    return static_cast<quint8>(seg.value().at(address - seg.key()));
 }
 
-QStringList HexFile::getHexFile() const
+bool HexFile::equal(const HexFile& other) const
 {
-    QStringList result;
-    const QChar zeropad('0');
-    const quint32 byteCount = 16;  // byte count is fixed to 16 bytes
-    const quint32 hexSize = static_cast<quint32>(QByteArray::size());
+    // segments are always maximal, so equal contents means equal maps
+    return m_size == other.m_size && m_segments == other.m_segments;
+}
 
-    int lines = (hexSize+(byteCount-1))/byteCount; // round up
+namespace
+{
 
-    for (int line = 0; line < lines; ++line)
+// Contiguous run at address: the stored bytes, or nullptr for unset bytes up
+// to the next segment (or to MAX_FLASH_BYTES)
+const char* spanAt(const HexFile::SegmentMap& segments, quint32 address, quint32* length)
+{
+    HexFile::SegmentMap::const_iterator next = segments.upperBound(address);
+    if (next != segments.constBegin())
     {
-        quint32 address   = line*byteCount;
-        quint16 addressSh = address;
+        HexFile::SegmentMap::const_iterator seg = std::prev(next);
+        const quint32 end = seg.key() + static_cast<quint32>(seg.value().size());
+        if (address < end)
+        {
+            *length = end - address;
+            return seg.value().constData() + (address - seg.key());
+        }
+    }
+    *length = (next != segments.constEnd() ? next.key() : qMax(address, MAX_FLASH_BYTES)) - address;
+    return nullptr;
+}
 
-        // preamble
+// First address >= address that is stored in either map
+quint32 nextStored(const HexFile::SegmentMap& a, const HexFile::SegmentMap& b, quint32 address)
+{
+    quint32 length;
+    quint32 result = spanAt(a, address, &length) ? address : address + length;
+    if (spanAt(b, address, &length))
+        return address;
+    return qMin(result, address + length);
+}
 
-        if(    (address>0)                          // new segment
-            && ((address% (0x10000))==0))
-        {
-            quint16 segAddress = address/16;
-            quint8 segChksum = ((2+2+(segAddress >> 8) + (segAddress & 0xFF)) ^ 0xFF) +1;
-            QString segStr = QString(":02000002%1%2\n")
-                                .arg(segAddress, 4, 16, zeropad)
-                                .arg(segChksum, 2, 16, zeropad);
-            result.append(segStr);
+// Word-wide compares; four words are folded per step so the common equal
+// case runs without a branch per word
+bool sameBytes(const char* a, const char* b, quint32 count)
+{
+    quint32 i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        quint64 x[4], y[4];
+        memcpy(x, a + i, 32);
+        memcpy(y, b + i, 32);
+        if (((x[0] ^ y[0]) | (x[1] ^ y[1]) | (x[2] ^ y[2]) | (x[3] ^ y[3])) != 0)
+            return false;
+    }
+    for (; i + 8 <= count; i += 8)
+    {
+        quint64 x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y)
+            return false;
+    }
+    for (; i < count; ++i)
+    {
+        if (a[i] != b[i])
+            return false;
+    }
+    return true;
+}
 
+bool rangeDiffers(const HexFile::SegmentMap& a, const HexFile::SegmentMap& b, quint32 start, quint32 end)
+{
+    while (start < end)
+    {
+        quint32 lengthA, lengthB;
+        const char* dataA = spanAt(a, start, &lengthA);
+        const char* dataB = spanAt(b, start, &lengthB);
+        const quint32 count = qMin(qMin(lengthA, lengthB), end - start);
+        if (dataA && dataB)
+        {
+            if (!sameBytes(dataA, dataB, count))
+                return true;
         }
-        quint32 thisLinesBytecount = (address+byteCount) > hexSize
-                                        ? hexSize-address
-                                        : byteCount;
-        QString str = QString(":%1%2%3").arg(thisLinesBytecount, 2,16, zeropad)
-                                        .arg(addressSh, 4, 16, zeropad)
-                                        .arg(0, 2, 16, zeropad);
-        quint8 checksum = thisLinesBytecount + (addressSh >> 8) + (addressSh & 0xFF);
-        for (quint32 i = 0; i < thisLinesBytecount; ++i)
+        else if (dataA || dataB)
         {
-            quint8 byte = QByteArray::operator[](address + i);
-            checksum += byte;
-            str += QString("%1").arg(byte, 2, 16, zeropad);
+            if (!isFilled(dataA ? dataA : dataB, count, HexFile::FILL_BYTE))
+                return true;
         }
-        checksum = (checksum ^ 0xFF)+1;
-        str += QString("%1\n").arg(checksum, 2, 16, zeropad);
-        result.append(str);
+        start += count;
     }
-    result.append(QString(":00000001FF\n"));
+    return false;
+}
+
+}
 
+HexFile::PageRanges HexFile::diffPages(const HexFile& other, quint32 pageSize) const
+{
+    PageRanges result;
+    // shared or identical segment data needs no page walk at all
+    if (pageSize == 0 || m_segments == other.m_segments)
+        return result;
+
+    quint32 limit = 0;
+    if (!m_segments.isEmpty())
+        limit = std::prev(m_segments.constEnd()).key() + static_cast<quint32>(std::prev(m_segments.constEnd()).value().size());
+    if (!other.m_segments.isEmpty())
+        limit = qMax(limit, std::prev(other.m_segments.constEnd()).key()
+                            + static_cast<quint32>(std::prev(other.m_segments.constEnd()).value().size()));
+
+    // only pages touching a stored segment in either image can differ
+    quint32 address = nextStored(m_segments, other.m_segments, 0);
+    while (address < limit)
+    {
+        const quint32 page = address - address % pageSize;
+        const quint32 pageEnd = page + pageSize;
+        if (rangeDiffers(m_segments, other.m_segments, page, qMin(pageEnd, limit)))
+        {
+            if (!result.isEmpty() && result.last().end == page)
+                result.last().end = pageEnd;
+            else
+                result.append({page, pageEnd});
+        }
+        address = pageEnd < limit ? nextStored(m_segments, other.m_segments, pageEnd) : limit;
+    }
     return result;
 }
+
+QDataStream& operator<<(QDataStream& out, const HexFile& hexFile)
+{
+    out << hexFile.m_size << static_cast<quint32>(hexFile.m_segments.size());
+    for (HexFile::SegmentMap::const_iterator it = hexFile.m_segments.constBegin(); it != hexFile.m_segments.constEnd(); ++it)
+        out << it.key() << it.value();
+    return out;
+}
+
+QDataStream& operator>>(QDataStream& in, HexFile& hexFile)
+{
+    hexFile.reset();
+    quint32 size, count;
+    in >> size >> count;
+    quint32 previousEnd = 0;
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i)
+    {
+        quint32 address;
+        QByteArray data;
+        in >> address >> data;
+
+        // only accept what setByte() could have produced
+        const quint32 length = static_cast<quint32>(data.size());
+        if ((address % HexFile::PAGE_SIZE) != 0 || length == 0 || (length % HexFile::PAGE_SIZE) != 0
+            || (i > 0 && address <= previousEnd) || address + length > MAX_FLASH_BYTES)
+        {
+            in.setStatus(QDataStream::ReadCorruptData);
+            break;
+        }
+        hexFile.m_segments.insert(address, data);
+        previousEnd = address + length;
+    }
+    if (in.status() != QDataStream::Ok || size > previousEnd)
+    {
+        in.setStatus(QDataStream::ReadCorruptData);
+        hexFile.reset();
+        return in;
+    }
+    hexFile.m_size = size;
+    return in;
+}
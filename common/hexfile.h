@@ -19,32 +19,90 @@
 #define HEXFILE_H
 
 #include <QByteArray>
+#include <QMap>
 #include <QString>
 #include <QStringList>
+#include <QVector>
 
-class HexFile : QByteArray // TODO: Use composition ISO private inheritance
+class QDataStream;
+
+// Sparse memory image. Data is kept in sorted, page-aligned segments; address
+// ranges not covered by a segment are unset and cost nothing.
+class HexFile
 {
 public:
+    // Storage granularity (the flash page size of the bigger AVR devices)
+    static const quint32 PAGE_SIZE = 128;
+
+    // Value of bytes inside a stored page that were never set (erased flash)
+    static const quint8 FILL_BYTE = 0xFF;
+
+    // Page-aligned start address -> data (a multiple of PAGE_SIZE bytes)
+    typedef QMap<quint32, QByteArray> SegmentMap;
+
+    // Half-open address range [start, end) covering whole pages
+    struct PageRange
+    {
+        quint32 start;
+        quint32 end;
+    };
+    typedef QVector<PageRange> PageRanges;
+
     HexFile();
 
     ~HexFile();
 
     void reset();
 
-    QStringList getHexFile() const;
-    bool load(QString fileName, bool verbose);
+    // threads: 1 decodes serially, > 1 splits the file into that many chunks
+    // decoded on a private thread pool, 0 picks automatically by file size
+    bool load(QString fileName, bool verbose, int threads = 0);
+
+    // Raw binary placed at baseAddress
+    bool loadBinary(QString fileName, quint32 baseAddress, bool verbose);
+    // PT_LOAD segments of an AVR ELF file, either flash or EEPROM contents
+    bool loadElf(QString fileName, bool eeprom, bool verbose);
+    // Picks the loader from the file contents/extension (ELF, .bin or HEX)
+    bool loadImage(QString fileName, bool eeprom, bool verbose);
 
     QString errorString() const {return m_lastError;}
 
     bool setByte(quint32 address, quint8 data);
+    bool setBytes(quint32 address, const quint8* data, quint32 count);
     bool append(quint8 data);
 
-    using QByteArray::size;
+    // One past the highest address that has been set
+    int size() const {return static_cast<int>(m_size);}
+
+    // Number of bytes actually stored (set bytes plus page padding)
+    quint32 usedBytes() const;
 
-    bool equal(const HexFile& other);
+    bool isSet(quint32 address) const;
+    quint8 at(quint32 address) const;
+
+    const SegmentMap& segments() const {return m_segments;}
+
+    bool equal(const HexFile& other) const;
+
+    // Pages of pageSize bytes whose contents differ, with adjacent pages
+    // merged into one range. Unset bytes compare as FILL_BYTE, so an unset
+    // page and an erased one are the same. Empty when nothing differs.
+    PageRanges diffPages(const HexFile& other, quint32 pageSize = PAGE_SIZE) const;
+
+    friend QDataStream& operator<<(QDataStream& out, const HexFile& hexFile);
+    friend QDataStream& operator>>(QDataStream& in, HexFile& hexFile);
 
 private:
-   QString m_lastError;
+    bool decodeParallel(const char* begin, const char* end, int chunkCount, bool verbose);
+    char* writable(quint32 address, quint32* available);
+
+    SegmentMap m_segments;
+    quint32 m_size;
+    QString m_lastError;
 };
 
+// Compact binary form (size and segments) used by the image cache
+QDataStream& operator<<(QDataStream& out, const HexFile& hexFile);
+QDataStream& operator>>(QDataStream& in, HexFile& hexFile);
+
 #endif
@@ -17,31 +17,111 @@
 
 #include <iostream>
 
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QThread>
+
+#include "hexencoder.h"
 #include "hexfile.h"
 #include "hexfiletester.h"
 #include "hexutils.h"
+#include "imagecache.h"
 
 using namespace std;
 
-void HexFileTester::test(const QString& filename)
+namespace
+{
+
+// The decoder HexFile::load replaced, kept as the benchmark baseline: one
+// QFile::readLine and one asciiToHex call per byte, stored byte by byte
+bool legacyLoad(const QString& filename, QByteArray& image)
+{
+    QFile f(filename);
+    if (!f.open(QIODevice::ReadOnly | QIODevice::Text))
+        return false;
+    image.clear();
+    image.reserve(262144);
+    quint32 extendedSegmentAddress = 0;
+    while (!f.atEnd())
+    {
+        QByteArray line = f.readLine();
+        if (line.size() < 11)
+            continue;
+        unsigned char byteCount = asciiToHex(line[1], line[2]);
+        unsigned char checkSum = byteCount;
+        quint32 address = asciiToHex(line[3], line[4]);
+        checkSum += (unsigned char) address;
+        address = address << 8;
+        address += asciiToHex(line[5], line[6]);
+        checkSum += (unsigned char) (address & 0xff);
+        unsigned char recordType = asciiToHex(line[7], line[8]);
+        checkSum += recordType;
+        if (line.size() < byteCount*2 + 11)
+            return false;
+        unsigned char fileCheckSum = asciiToHex(line[(byteCount*2)+9], line[(byteCount*2)+10]);
+
+        switch (recordType)
+        {
+        case 2:
+            extendedSegmentAddress = asciiToHex(line[9], line[10]) << 8;
+            checkSum += (extendedSegmentAddress >> 8);
+            extendedSegmentAddress += asciiToHex(line[11], line[12]);
+            checkSum += (extendedSegmentAddress & 0xff);
+            break;
+        case 1:
+            break;
+        case 0:
+            for (unsigned int i = 0; i < (2 * ((unsigned int)byteCount)); i += 2)
+            {
+                unsigned char dataByte = asciiToHex(line[i+9], line[i+10]);
+                checkSum += dataByte;
+                const int target = static_cast<int>(address + (extendedSegmentAddress * 16) + (i >> 1));
+                if (target > image.size())
+                    image.append(QByteArray(target - image.size(), 0));
+                if (target == image.size())
+                    image.append(char(dataByte));
+                else
+                    image[target] = char(dataByte);
+            }
+            break;
+        default:
+            return false;
+        }
+        if (((checkSum + fileCheckSum) & 0xff) != 0)
+            return false;
+    }
+    return true;
+}
+
+}
+
+bool HexFileTester::test(const QString& filename)
 {
     HexFile hf;
+    bool ok = true;
 
     // test load
     if(!hf.load(filename, true))
     {
         cout << "Error opening hexfile '" << filename.toUtf8().constData() << "': " << hf.errorString().toUtf8().constData() << endl;
-        return;
+        return false;
     }
 
-    // test write routine
+    // test write routine, and that the output loads back unchanged
     if (!writeHexfile(filename+"_out2.hex", hf))
-        return;
+        return false;
+    HexFile reloaded;
+    if (!reloaded.load(filename+"_out2.hex", false) || !reloaded.diffPages(hf).isEmpty())
+    {
+        cout << "Written hexfile does not load back unchanged" << endl;
+        ok = false;
+    }
 
     // test empty file
     hf.reset();
     if (!writeHexfile(filename+"_out3.hex", hf))
-        return;
+        return false;
 
     // test add
     hf.reset();
@@ -56,13 +136,13 @@ void HexFileTester::test(const QString& filename)
     hf.append(3);
     hf.append(4);
     if (!writeHexfile(filename+"_out4.hex", hf))
-        return;
+        return false;
 
     // test set
     hf.setByte(1, 'e');
     hf.setByte(8, 255);
     if (!writeHexfile(filename+"_out5.hex", hf))
-        return;
+        return false;
 
     // test set after current end
     hf.setByte(654, 255);
@@ -72,7 +152,7 @@ void HexFileTester::test(const QString& filename)
     hf.append(3);
     hf.append(4);
     if (!writeHexfile(filename+"_out6.hex", hf))
-        return;
+        return false;
 
     // test extended (>64k) range
     hf.setByte(0x10000, 0x11);
@@ -84,5 +164,182 @@ void HexFileTester::test(const QString& filename)
     hf.append(4);
     hf.setByte(0x205FF, 0x33);
     if (!writeHexfile(filename+"_out7.hex", hf))
-        return; // TODO: Complain?
+        return false;
+
+    // test page diff
+    HexFile changed = hf;
+    if (!changed.diffPages(hf).isEmpty())
+    {
+        cout << "Diff of identical images is not empty" << endl;
+        ok = false;
+    }
+    changed.setByte(0x10001, 0x44);
+    changed.setByte(0x30000, 0xFF);
+    const HexFile::PageRanges ranges = changed.diffPages(hf, 256);
+    if (ranges.size() != 1 || ranges[0].start != 0x10000 || ranges[0].end != 0x10100)
+    {
+        cout << "Unexpected page diff" << endl;
+        ok = false;
+    }
+
+    // test fill region against the same image built byte by byte
+    HexFile erased;
+    for (int i = 0; i < 0x10100; i++)
+        erased.append(0xFF);
+    if (HexEncoder(FillRegion{0, 0x10100, 0xFF}).toByteArray() != HexEncoder(erased).toByteArray())
+    {
+        cout << "Fill region encodes differently" << endl;
+        ok = false;
+    }
+
+    // test segment merging: separate pages stay separate segments until a
+    // write bridges them, and overlapping writes replace in place
+    quint8 pattern[64];
+    for (int i = 0; i < 64; i++)
+        pattern[i] = static_cast<quint8>(i);
+    HexFile merged;
+    merged.setBytes(0, pattern, 10);
+    merged.setBytes(2 * HexFile::PAGE_SIZE, pattern, 10);
+    if (merged.segments().size() != 2)
+    {
+        cout << "Pages with a gap between them were merged" << endl;
+        ok = false;
+    }
+    merged.setBytes(HexFile::PAGE_SIZE - 8, pattern, 16);
+    if (merged.segments().size() != 1 || merged.segments().firstKey() != 0
+        || merged.segments().first().size() != static_cast<int>(3 * HexFile::PAGE_SIZE))
+    {
+        cout << "Adjacent segments were not merged" << endl;
+        ok = false;
+    }
+    merged.setBytes(5, pattern + 32, 10);
+    if (merged.at(4) != 4 || merged.at(5) != 32 || merged.at(14) != 41 || merged.segments().size() != 1)
+    {
+        cout << "Overlapping write did not replace the stored bytes" << endl;
+        ok = false;
+    }
+
+    // test gaps inside a stored page read as erased flash
+    if (!merged.isSet(50) || merged.at(50) != HexFile::FILL_BYTE
+        || merged.at(3 * HexFile::PAGE_SIZE) != HexFile::FILL_BYTE || merged.isSet(3 * HexFile::PAGE_SIZE))
+    {
+        cout << "Gap bytes do not read as FILL_BYTE" << endl;
+        ok = false;
+    }
+
+    // test equal() does not depend on the order the image was built in
+    HexFile forward;
+    HexFile backward;
+    forward.setBytes(0, pattern, 64);
+    forward.setBytes(1000, pattern, 64);
+    forward.setBytes(600, pattern, 64);
+    for (int i = 63; i >= 0; i--)
+    {
+        backward.setByte(600 + i, pattern[i]);
+        backward.setByte(1000 + i, pattern[i]);
+        backward.setByte(i, pattern[i]);
+    }
+    if (!forward.equal(backward) || !backward.equal(forward))
+    {
+        cout << "Images built in different orders are not equal" << endl;
+        ok = false;
+    }
+    backward.setByte(601, 0xAA);
+    if (forward.equal(backward))
+    {
+        cout << "Different images compare equal" << endl;
+        ok = false;
+    }
+
+    // test the image cache notices an edit that keeps size and modification
+    // time, as after cp -p or tar
+    const QString cached = filename+"_cache.hex";
+    if (!writeHexfile(cached, forward))
+        return false;
+    QDateTime modified;
+    {
+        QFile f(cached);
+        f.open(QIODevice::ReadWrite);
+        modified = f.fileTime(QFileDevice::FileModificationTime);
+    }
+    ImageCache cache;
+    HexFile fromCache;
+    if (!cache.load(cached, false, fromCache, false) || !fromCache.equal(forward))
+    {
+        cout << "Image cache did not load '" << cached.toUtf8().constData() << "'" << endl;
+        return false;
+    }
+    HexFile edited = forward;
+    edited.setByte(10, 0x5A);
+    if (!writeHexfile(cached, edited))
+        return false;
+    {
+        QFile f(cached);
+        if (!f.open(QIODevice::ReadWrite) || !f.setFileTime(modified, QFileDevice::FileModificationTime))
+        {
+            cout << "Could not restore the modification time of '" << cached.toUtf8().constData() << "'" << endl;
+            return false;
+        }
+    }
+    if (!cache.load(cached, false, fromCache, false) || !fromCache.equal(edited))
+    {
+        cout << "Image cache returned a stale image for an edited file" << endl;
+        ok = false;
+    }
+    return ok;
+}
+
+void HexFileTester::benchmarkLoad(const QString& filename, int iterations)
+{
+    QFile f(filename);
+    if (!f.open(QIODevice::ReadOnly))
+    {
+        cout << "Error opening hexfile '" << filename.toUtf8().constData() << "'" << endl;
+        return;
+    }
+    const QByteArray contents = f.readAll();
+    const qint64 lines = contents.count('\n');
+    f.close();
+
+    // the line by line decoder HexFile used to have is the baseline
+    double baselineSeconds = 0;
+    {
+        QByteArray image;
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < iterations; ++i)
+        {
+            if (!legacyLoad(filename, image))
+            {
+                cout << "Baseline load failed" << endl;
+                return;
+            }
+        }
+        baselineSeconds = timer.nsecsElapsed() / 1e9;
+        cout << "baseline: " << iterations << " x " << lines << " lines in " << baselineSeconds << " s: "
+             << qRound64(lines * iterations / baselineSeconds) << " lines/s, "
+             << contents.size() * iterations / baselineSeconds / (1024 * 1024) << " MiB/s" << endl;
+    }
+
+    // serial decoder first, then one chunk per pool thread
+    const int threadCounts[] = {1, qMax(QThread::idealThreadCount(), 2)};
+    for (int threads : threadCounts)
+    {
+        HexFile hf;
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < iterations; ++i)
+        {
+            if (!hf.load(filename, false, threads))
+            {
+                cout << "Load failed: " << hf.errorString().toUtf8().constData() << endl;
+                return;
+            }
+        }
+        const double seconds = timer.nsecsElapsed() / 1e9;
+        cout << threads << " thread(s): " << iterations << " x " << lines << " lines in " << seconds << " s: "
+             << qRound64(lines * iterations / seconds) << " lines/s, "
+             << contents.size() * iterations / seconds / (1024 * 1024) << " MiB/s, "
+             << baselineSeconds / seconds << "x baseline" << endl;
+    }
 }
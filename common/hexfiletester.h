@@ -24,7 +24,9 @@ class HexFileTester
 {
 public:
     HexFileTester(){}
-    void test(const QString& filename);
+    // Writes <filename>_out*.hex next to filename; false if any check failed
+    bool test(const QString& filename);
+    void benchmarkLoad(const QString& filename, int iterations = 20);
 };
 
 #endif
@@ -17,14 +17,39 @@
 
 #include <iostream>
 #include <iomanip>
+#include <cstring>
 
 #include <QFile>
 #include <QString>
 
+#include "hexencoder.h"
 #include "hexfile.h"
+#include "hexutils.h"
 
 using namespace std;
 
+#define X HEX_INVALID
+const unsigned char HEX_NIBBLE[256] =
+{
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,   // '0'..'9'
+    X,10,11,12,13,14,15, X, X, X, X, X, X, X, X, X,   // 'A'..'F'
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X,10,11,12,13,14,15, X, X, X, X, X, X, X, X, X,   // 'a'..'f'
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+#undef X
+
 bool writeHexfile(const QString& filename, const HexFile& hf)
 {
     QFile out(filename);
@@ -33,27 +58,44 @@ bool writeHexfile(const QString& filename, const HexFile& hf)
         cout << "Could not write file '" << filename.data() << "'" << endl;
         return false;
     }
-    out.write(hf.getHexFile().join("").toLocal8Bit());
+    const bool ok = HexEncoder(hf).writeTo(&out);
     out.close();
-    return true;
+    return ok;
 }
 
 
 unsigned char asciiToHex(unsigned char a)
 {
-    if(a >= 'a')
-        return a - 'a' + 10;
-
-    if(a >= 'A')
-        return a - 'A' + 10;
-    
-    if (a >= '0')
-        return a - '0';
-
-    return 0;
+    return HEX_NIBBLE[a] & 0x0F;
 }
 
 unsigned char asciiToHex(unsigned char high, unsigned char low)
 {
     return (asciiToHex(high) << 4) + asciiToHex(low);
 }
+
+bool isFilled(const char* data, unsigned int count, unsigned char value)
+{
+    const quint64 word = 0x0101010101010101ULL * value;
+    unsigned int i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        quint64 x[4];
+        memcpy(x, data + i, 32);
+        if (((x[0] ^ word) | (x[1] ^ word) | (x[2] ^ word) | (x[3] ^ word)) != 0)
+            return false;
+    }
+    for (; i + 8 <= count; i += 8)
+    {
+        quint64 x;
+        memcpy(&x, data + i, 8);
+        if (x != word)
+            return false;
+    }
+    for (; i < count; ++i)
+    {
+        if (static_cast<unsigned char>(data[i]) != value)
+            return false;
+    }
+    return true;
+}
@@ -15,12 +15,25 @@
 // You should have received a copy of the GNU General Public License
 // along with c45b.  If not, see <http://www.gnu.org/licenses/>.
 
+#ifndef HEXUTILS_H
+#define HEXUTILS_H
+
 class HexFile;
 class QString;
 
 bool writeHexfile(const QString& filename, const HexFile& hf);
 
-char asciiToHex(unsigned char a);
+unsigned char asciiToHex(unsigned char a);
+
+unsigned char asciiToHex(unsigned char high, unsigned char low);
+
+// True if all count bytes at data equal value; compares a word at a time
+bool isFilled(const char* data, unsigned int count, unsigned char value);
+
+// Nibble value of every ASCII character; non-hex characters have HEX_INVALID set
+const unsigned char HEX_INVALID = 0x10;
+extern const unsigned char HEX_NIBBLE[256];
 
-char asciiToHex(unsigned char high, unsigned char low);
+constexpr char HEX_DIGITS[] = "0123456789abcdef";
 
+#endif
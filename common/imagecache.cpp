@@ -0,0 +1,188 @@
+// This file is part of c45b.
+
+// c45b is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// c45b is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with c45b.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+
+#include <cstring>
+
+#include "imagecache.h"
+
+namespace
+{
+
+const quint32 CACHE_MAGIC = 0x43343549;  // "C45I"
+const quint32 CACHE_VERSION = 2;
+const int CACHE_STREAM_VERSION = QDataStream::Qt_5_6;
+
+// Limits for the on-disk cache, enforced after every write
+const qint64 MAX_DISK_BYTES = 64*1024*1024;
+const qint64 MAX_DISK_AGE_SECS = 30*24*60*60;
+
+}
+
+void ImageCache::setCacheDirectory(const QString& directory)
+{
+    m_directory = directory;
+    if (!m_directory.isEmpty())
+        QDir().mkpath(m_directory);
+}
+
+bool ImageCache::load(const QString& fileName, bool eeprom, HexFile& image, bool verbose)
+{
+    QFile f(fileName);
+    if (!f.open(QIODevice::ReadOnly))
+    {
+        ++m_misses;
+        return image.loadImage(fileName, eeprom, verbose);
+    }
+
+    const QFileInfo info(f);
+    const qint64 size = f.size();
+    const QString key = info.absoluteFilePath() + (eeprom ? "#eeprom" : "#flash");
+
+    // Always hash: a modification time can be too coarse, or be restored by
+    // cp -p or tar, and hashing is cheap next to parsing
+    quint64 hash;
+    if (const uchar* mapped = size > 0 ? f.map(0, size) : nullptr)
+        hash = contentHash(reinterpret_cast<const char*>(mapped), size);
+    else
+    {
+        const QByteArray contents = f.readAll();
+        hash = contentHash(contents.constData(), contents.size());
+    }
+    f.close();
+
+    QHash<QString, Entry>::const_iterator it = m_entries.constFind(key);
+    if (it != m_entries.constEnd() && it->size == size && it->hash == hash)
+    {
+        ++m_hits;
+        image = it->image;
+        return true;
+    }
+
+    const QString path = diskPath(fileName, eeprom, hash);
+    if (!path.isEmpty() && loadFromDisk(path, image))
+    {
+        ++m_hits;
+        m_entries.insert(key, Entry{size, hash, image});
+        return true;
+    }
+
+    ++m_misses;
+    if (!image.loadImage(fileName, eeprom, verbose))
+    {
+        m_entries.remove(key);
+        return false;
+    }
+    m_entries.insert(key, Entry{size, hash, image});
+    if (!path.isEmpty())
+    {
+        saveToDisk(path, image);
+        pruneDisk();
+    }
+    return true;
+}
+
+void ImageCache::clear()
+{
+    m_entries.clear();
+    m_hits = 0;
+    m_misses = 0;
+}
+
+quint64 ImageCache::contentHash(const char* data, qint64 length)
+{
+    // FNV-1a style, but eight bytes per step; the shift folds the high bits
+    // of each word back into the low ones before the next multiply
+    const quint64 prime = 0x100000001b3ULL;
+    quint64 hash = 0xcbf29ce484222325ULL ^ static_cast<quint64>(length);
+    qint64 i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        quint64 word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 29;
+    }
+    for (; i < length; ++i)
+    {
+        hash ^= static_cast<uchar>(data[i]);
+        hash *= prime;
+    }
+    return hash;
+}
+
+QString ImageCache::diskPath(const QString& fileName, bool eeprom, quint64 hash) const
+{
+    if (m_directory.isEmpty())
+        return QString();
+    // The loader depends on the extension, so it is part of the key
+    return QDir(m_directory).filePath(QString("%1-%2-%3.img")
+                                      .arg(hash, 16, 16, QChar('0'))
+                                      .arg(eeprom ? "eeprom" : "flash")
+                                      .arg(QFileInfo(fileName).suffix().toLower()));
+}
+
+bool ImageCache::loadFromDisk(const QString& path, HexFile& image) const
+{
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly))
+        return false;
+    QDataStream in(&f);
+    in.setVersion(CACHE_STREAM_VERSION);
+    quint32 magic, version;
+    in >> magic >> version;
+    if (magic != CACHE_MAGIC || version != CACHE_VERSION)
+        return false;
+    HexFile cached;
+    in >> cached;
+    if (in.status() != QDataStream::Ok)
+        return false;
+    image = cached;
+    return true;
+}
+
+void ImageCache::saveToDisk(const QString& path, const HexFile& image) const
+{
+    // Write atomically so a concurrent reader never sees a partial entry
+    QSaveFile f(path);
+    if (!f.open(QIODevice::WriteOnly))
+        return;
+    QDataStream out(&f);
+    out.setVersion(CACHE_STREAM_VERSION);
+    out << CACHE_MAGIC << CACHE_VERSION << image;
+    if (out.status() == QDataStream::Ok)
+        f.commit();
+}
+
+void ImageCache::pruneDisk() const
+{
+    QDir dir(m_directory);
+    const QFileInfoList files = dir.entryInfoList(QStringList("*.img"), QDir::Files, QDir::Time);
+    const QDateTime oldest = QDateTime::currentDateTime().addSecs(-MAX_DISK_AGE_SECS);
+    qint64 total = 0;
+    // Newest first, so everything past the size budget is the oldest
+    for (const QFileInfo& file : files)
+    {
+        total += file.size();
+        if (total > MAX_DISK_BYTES || file.lastModified() < oldest)
+            QFile::remove(file.absoluteFilePath());
+    }
+}
@@ -0,0 +1,67 @@
+// This file is part of c45b.
+
+// c45b is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// c45b is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with c45b.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include <QHash>
+#include <QString>
+
+#include "hexfile.h"
+
+// Cache of parsed images keyed by path, size and a hash of the file contents,
+// which is computed on every load. Entries live in memory and, if a cache
+// directory is set, in a compact binary format on disk so they survive
+// restarts. The disk cache is kept below 64 MiB and entries older than 30
+// days are removed.
+class ImageCache
+{
+public:
+    ImageCache() {}
+
+    // Empty directory disables the on-disk cache
+    void setCacheDirectory(const QString& directory);
+
+    // Same as HexFile::loadImage, but skips parsing when the file is unchanged.
+    // On failure the error is available through image.errorString().
+    bool load(const QString& fileName, bool eeprom, HexFile& image, bool verbose);
+
+    void clear();
+
+    quint64 hits() const {return m_hits;}
+    quint64 misses() const {return m_misses;}
+
+    static quint64 contentHash(const char* data, qint64 length);
+
+private:
+    struct Entry
+    {
+        qint64 size;
+        quint64 hash;
+        HexFile image;
+    };
+
+    QString diskPath(const QString& fileName, bool eeprom, quint64 hash) const;
+    bool loadFromDisk(const QString& path, HexFile& image) const;
+    void saveToDisk(const QString& path, const HexFile& image) const;
+    void pruneDisk() const;
+
+    QHash<QString, Entry> m_entries;
+    QString m_directory;
+    quint64 m_hits = 0;
+    quint64 m_misses = 0;
+};
+
+#endif
@@ -0,0 +1,210 @@
+// This file is part of c45b.
+
+// c45b is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// c45b is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with c45b.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+#include "log.h"
+
+namespace
+{
+
+const size_t QUEUE_SIZE = 1024;  // power of two
+
+struct Slot
+{
+    std::atomic<size_t> sequence;
+    std::chrono::steady_clock::time_point time;
+    int level;
+    char text[Log::MESSAGE_LENGTH];
+};
+
+// Bounded multi-producer queue (Vyukov) with a single consumer, the writer.
+// The writer sleeps on m_changed while the queue is empty; only the first
+// message after that takes the mutex to wake it, so producers stay
+// lock-free otherwise.
+class Logger
+{
+public:
+    Logger()
+        : m_enqueue(0), m_dequeue(0), m_dropped(0), m_sleeping(false), m_stop(false)
+    {
+        for (size_t i = 0; i < QUEUE_SIZE; ++i)
+            m_slots[i].sequence.store(i, std::memory_order_relaxed);
+        m_start = std::chrono::steady_clock::now();
+        m_writer = std::thread([this]() { run(); });
+    }
+
+    ~Logger()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop.store(true);
+        }
+        m_changed.notify_all();
+        m_writer.join();
+    }
+
+    Slot* acquire()
+    {
+        size_t pos = m_enqueue.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Slot* slot = &m_slots[pos & (QUEUE_SIZE - 1)];
+            const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    return slot;
+            }
+            else if (diff < 0)
+            {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            else
+                pos = m_enqueue.load(std::memory_order_relaxed);
+        }
+    }
+
+    void publish(Slot* slot)
+    {
+        const size_t pos = slot->sequence.load(std::memory_order_relaxed);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        // pairs with the fence in sleep(): either the writer sees this slot
+        // or we see it asleep
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_sleeping.load(std::memory_order_relaxed) && m_sleeping.exchange(false))
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_changed.notify_all();
+        }
+    }
+
+    quint64 dropped() const {return m_dropped.load(std::memory_order_relaxed);}
+
+    void flush()
+    {
+        const size_t target = m_enqueue.load(std::memory_order_acquire);
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [&]() { return m_dequeue.load(std::memory_order_acquire) >= target; });
+    }
+
+private:
+    bool ready() const
+    {
+        const size_t pos = m_dequeue.load(std::memory_order_relaxed);
+        return m_slots[pos & (QUEUE_SIZE - 1)].sequence.load(std::memory_order_acquire) == pos + 1;
+    }
+
+    bool writeNext()
+    {
+        if (!ready())
+            return false;
+        const size_t pos = m_dequeue.load(std::memory_order_relaxed);
+        Slot& slot = m_slots[pos & (QUEUE_SIZE - 1)];
+        static const char* const names[] = {"trace", "debug", "info", "warning", "error"};
+        const double seconds = std::chrono::duration<double>(slot.time - m_start).count();
+        fprintf(stderr, "%10.6f %-7s %s\n", seconds, names[qBound(0, slot.level, 4)], slot.text);
+        slot.sequence.store(pos + QUEUE_SIZE, std::memory_order_release);
+        m_dequeue.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Blocks until a producer publishes into the empty queue or we stop
+    void sleep()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (ready())
+        {
+            m_sleeping.store(false, std::memory_order_relaxed);
+            return;
+        }
+        m_changed.wait(lock, [this]() { return !m_sleeping.load() || m_stop.load(); });
+        m_sleeping.store(false, std::memory_order_relaxed);
+    }
+
+    void run()
+    {
+        for (;;)
+        {
+            bool wrote = false;
+            while (writeNext())
+                wrote = true;
+            if (wrote)
+            {
+                fflush(stderr);
+                // wake flush() callers waiting for this batch
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_changed.notify_all();
+            }
+            else if (m_stop.load())
+                return;
+            else
+                sleep();
+        }
+    }
+
+    Slot m_slots[QUEUE_SIZE];
+    std::atomic<size_t> m_enqueue;
+    std::atomic<size_t> m_dequeue;
+    std::atomic<quint64> m_dropped;
+    std::atomic<bool> m_sleeping;
+    std::atomic<bool> m_stop;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::chrono::steady_clock::time_point m_start;
+    std::thread m_writer;
+};
+
+Logger& logger()
+{
+    static Logger instance;
+    return instance;
+}
+
+}
+
+void Log::write(int level, const char* format, ...)
+{
+    Slot* slot = logger().acquire();
+    if (!slot)
+        return;
+    slot->time = std::chrono::steady_clock::now();
+    slot->level = level;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(slot->text, sizeof(slot->text), format, args);
+    va_end(args);
+    logger().publish(slot);
+}
+
+quint64 Log::dropped()
+{
+    return logger().dropped();
+}
+
+void Log::flush()
+{
+    logger().flush();
+}
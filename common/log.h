@@ -0,0 +1,72 @@
+// This file is part of c45b.
+
+// c45b is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// c45b is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with c45b.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <QtGlobal>
+
+// Levelled logging for the protocol code. Levels below C45B_LOG_LEVEL are
+// removed at compile time, arguments included. Enabled messages are
+// formatted into a slot of a lock-free queue and written to stderr by a
+// background thread, so callers never wait for I/O. When the queue is full
+// messages are dropped and counted rather than blocking.
+
+#define C45B_LOG_LEVEL_TRACE   0
+#define C45B_LOG_LEVEL_DEBUG   1
+#define C45B_LOG_LEVEL_INFO    2
+#define C45B_LOG_LEVEL_WARNING 3
+#define C45B_LOG_LEVEL_ERROR   4
+#define C45B_LOG_LEVEL_OFF     5
+
+// e.g. DEFINES += C45B_LOG_LEVEL=C45B_LOG_LEVEL_TRACE
+#ifndef C45B_LOG_LEVEL
+#  ifdef QT_NO_DEBUG
+#    define C45B_LOG_LEVEL C45B_LOG_LEVEL_INFO
+#  else
+#    define C45B_LOG_LEVEL C45B_LOG_LEVEL_DEBUG
+#  endif
+#endif
+
+namespace Log
+{
+
+// printf-style; at most MESSAGE_LENGTH - 1 characters are kept
+void write(int level, const char* format, ...)
+#ifdef Q_CC_GNU
+    __attribute__((format(printf, 2, 3)))
+#endif
+    ;
+
+const int MESSAGE_LENGTH = 240;
+
+// Messages lost because the queue was full
+quint64 dropped();
+
+// Waits until everything queued so far has been written
+void flush();
+
+}
+
+#define C45B_LOG(level, ...) \
+    do { if ((level) >= C45B_LOG_LEVEL) Log::write((level), __VA_ARGS__); } while (0)
+
+#define LOG_TRACE(...)   C45B_LOG(C45B_LOG_LEVEL_TRACE, __VA_ARGS__)
+#define LOG_DEBUG(...)   C45B_LOG(C45B_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...)    C45B_LOG(C45B_LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARNING(...) C45B_LOG(C45B_LOG_LEVEL_WARNING, __VA_ARGS__)
+#define LOG_ERROR(...)   C45B_LOG(C45B_LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,199 @@
+// This file is part of c45b.
+
+// c45b is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// c45b is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with c45b.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <cstdio>
+
+#include <QSaveFile>
+
+#include "uploadtrace.h"
+
+UploadTrace::UploadTrace(int capacity)
+{
+    int size = 1;
+    while (size < capacity)
+        size <<= 1;
+    m_entries.resize(size);
+    m_mask = static_cast<quint64>(size - 1);
+    m_clock.start();
+}
+
+void UploadTrace::clear()
+{
+    m_next = 0;
+}
+
+QVector<UploadTrace::Entry> UploadTrace::entries() const
+{
+    const quint64 size = static_cast<quint64>(m_entries.size());
+    const quint64 first = m_next > size ? m_next - size : 0;
+    QVector<Entry> result;
+    result.reserve(static_cast<int>(m_next - first));
+    for (quint64 i = first; i < m_next; ++i)
+        result.append(m_entries[static_cast<int>(i & m_mask)]);
+    return result;
+}
+
+const char* UploadTrace::eventName(Event event)
+{
+    switch (event)
+    {
+    case Event::ConnectStart: return "connect";
+    case Event::Connected: return "connected";
+    case Event::UploadStart: return "upload";
+    case Event::UploadEnd: return "upload end";
+    case Event::Write: return "write";
+    case Event::RecordAck: return "record ack";
+    case Event::PageAck: return "page";
+    case Event::Xoff: return "XOFF";
+    case Event::Xon: return "XON";
+    case Event::Error: return "error";
+    }
+    return "?";
+}
+
+bool UploadTrace::exportChromeTrace(QIODevice* device) const
+{
+    const QVector<Entry> events = entries();
+    QByteArray out;
+    out.reserve(64 + events.size() * 96);
+    out += "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+    char line[192];
+    bool first = true;
+    auto append = [&](int length) {
+        if (!first)
+            out += ",\n";
+        first = false;
+        out.append(line, length);
+    };
+
+    qint64 connectStart = -1;
+    qint64 uploadStart = -1;
+    qint64 lastPage = -1;
+    qint64 xoff = -1;
+    for (const Entry& e : events)
+    {
+        const double us = e.ns / 1000.0;
+        switch (e.event)
+        {
+        case Event::ConnectStart:
+            connectStart = e.ns;
+            break;
+        case Event::Connected:
+            if (connectStart >= 0)
+                append(snprintf(line, sizeof(line), "{\"name\":\"connect\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+                                connectStart / 1000.0, (e.ns - connectStart) / 1000.0));
+            connectStart = -1;
+            break;
+        case Event::UploadStart:
+            uploadStart = lastPage = e.ns;
+            break;
+        case Event::UploadEnd:
+        case Event::Error:
+            if (uploadStart >= 0)
+                append(snprintf(line, sizeof(line), "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+                                e.event == Event::Error ? "upload (failed)" : "upload",
+                                uploadStart / 1000.0, (e.ns - uploadStart) / 1000.0));
+            uploadStart = lastPage = -1;
+            break;
+        case Event::PageAck:
+            // a page spans from the previous acknowledgement to this one
+            if (lastPage >= 0)
+                append(snprintf(line, sizeof(line), "{\"name\":\"page\",\"ph\":\"X\",\"pid\":1,\"tid\":2,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"page\":%u}}",
+                                lastPage / 1000.0, (e.ns - lastPage) / 1000.0, e.arg));
+            lastPage = e.ns;
+            break;
+        case Event::Xoff:
+            xoff = e.ns;
+            break;
+        case Event::Xon:
+            if (xoff >= 0)
+                append(snprintf(line, sizeof(line), "{\"name\":\"device busy\",\"ph\":\"X\",\"pid\":1,\"tid\":3,\"ts\":%.3f,\"dur\":%.3f}",
+                                xoff / 1000.0, (e.ns - xoff) / 1000.0));
+            xoff = -1;
+            break;
+        case Event::Write:
+            append(snprintf(line, sizeof(line), "{\"name\":\"write\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":4,\"ts\":%.3f,\"args\":{\"bytes\":%u}}",
+                            us, e.arg));
+            break;
+        case Event::RecordAck:
+            append(snprintf(line, sizeof(line), "{\"name\":\"record ack\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":2,\"ts\":%.3f}", us));
+            break;
+        }
+    }
+    out += "\n]}\n";
+    return device->write(out) == out.size();
+}
+
+bool UploadTrace::exportChromeTrace(const QString& fileName) const
+{
+    QSaveFile f(fileName);
+    if (!f.open(QIODevice::WriteOnly))
+        return false;
+    return exportChromeTrace(&f) && f.commit();
+}
+
+QVector<quint32> UploadTrace::pageLatencyHistogram() const
+{
+    QVector<quint32> result(32, 0);
+    qint64 last = -1;
+    for (const Entry& e : entries())
+    {
+        if (e.event == Event::UploadStart)
+            last = e.ns;
+        else if (e.event == Event::PageAck && last >= 0)
+        {
+            quint64 us = static_cast<quint64>((e.ns - last) / 1000);
+            int bucket = 0;
+            while (us > 1 && bucket < result.size() - 1)
+            {
+                us >>= 1;
+                ++bucket;
+            }
+            ++result[bucket];
+            last = e.ns;
+        }
+    }
+    return result;
+}
+
+qint64 UploadTrace::firstWriteLatency() const
+{
+    qint64 result = -1;
+    qint64 start = -1;
+    for (const Entry& e : entries())
+    {
+        if (e.event == Event::UploadStart)
+        {
+            start = e.ns;
+            result = -1;
+        }
+        else if (e.event == Event::Write && start >= 0 && result < 0)
+            result = e.ns - start;
+    }
+    return result;
+}
+
+QString UploadTrace::pageLatencyReport() const
+{
+    const QVector<quint32> histogram = pageLatencyHistogram();
+    QString result;
+    for (int i = 0; i < histogram.size(); ++i)
+    {
+        if (histogram[i])
+            result += QString("%1-%2 us: %3\n").arg(i ? 1ULL << i : 0).arg((1ULL << (i + 1)) - 1).arg(histogram[i]);
+    }
+    return result;
+}
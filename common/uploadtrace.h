@@ -0,0 +1,97 @@
+// This file is part of c45b.
+
+// c45b is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// c45b is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with c45b.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef UPLOADTRACE_H
+#define UPLOADTRACE_H
+
+#include <QElapsedTimer>
+#include <QString>
+#include <QVector>
+
+class QIODevice;
+
+// Timestamped protocol events in a preallocated ring buffer. record() is a
+// clock read and a store, so tracing can stay on; when the ring is full the
+// oldest events are overwritten. Not thread safe: use from the owner's thread.
+class UploadTrace
+{
+public:
+    enum class Event : quint8
+    {
+        ConnectStart,
+        Connected,
+        UploadStart,
+        UploadEnd,
+        Write,       // arg: bytes handed to the port
+        RecordAck,   // '.'
+        PageAck,     // '*', arg: page number
+        Xoff,
+        Xon,
+        Error,
+    };
+
+    struct Entry
+    {
+        qint64 ns;
+        quint32 arg;
+        Event event;
+    };
+
+    // capacity is rounded up to a power of two
+    explicit UploadTrace(int capacity = 1 << 16);
+
+    void setEnabled(bool enabled) {m_enabled = enabled;}
+    bool isEnabled() const {return m_enabled;}
+
+    void record(Event event, quint32 arg = 0)
+    {
+        if (!m_enabled)
+            return;
+        Entry& entry = m_entries[static_cast<int>(m_next++ & m_mask)];
+        entry.ns = m_clock.nsecsElapsed();
+        entry.arg = arg;
+        entry.event = event;
+    }
+
+    void clear();
+
+    // Events still in the ring, oldest first
+    QVector<Entry> entries() const;
+
+    // Chrome/Perfetto trace JSON (chrome://tracing, ui.perfetto.dev)
+    bool exportChromeTrace(QIODevice* device) const;
+    bool exportChromeTrace(const QString& fileName) const;
+
+    // Time between consecutive page acknowledgements, in power-of-two
+    // microsecond buckets: bucket 0 counts latencies below 2 us, bucket i > 0
+    // those in [2^i, 2^(i+1)) us
+    QVector<quint32> pageLatencyHistogram() const;
+    QString pageLatencyReport() const;
+
+    // Nanoseconds from the last UploadStart to the first Write after it,
+    // -1 if there is none in the ring
+    qint64 firstWriteLatency() const;
+
+    static const char* eventName(Event event);
+
+private:
+    QVector<Entry> m_entries;
+    quint64 m_mask;
+    quint64 m_next = 0;
+    QElapsedTimer m_clock;
+    bool m_enabled = true;
+};
+
+#endif
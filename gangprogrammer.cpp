@@ -0,0 +1,113 @@
+#include "gangprogrammer.h"
+
+#include "serial.h"
+
+GangProgrammer::GangProgrammer(int threads, QObject *parent) : QObject(parent)
+{
+    if (threads <= 0)
+        threads = qMax(QThread::idealThreadCount(), 1);
+    for (int i = 0; i < threads; ++i)
+    {
+        QThread* thread = new QThread(this);
+        thread->setObjectName(QString("gang-io-%1").arg(i));
+        thread->start(QThread::HighPriority);
+        m_threads.append(thread);
+    }
+}
+
+GangProgrammer::~GangProgrammer()
+{
+    releaseSessions();
+    for (QThread* thread : m_threads)
+    {
+        thread->quit();
+        thread->wait();
+    }
+}
+
+void GangProgrammer::releaseSessions()
+{
+    // a Serial must be destroyed on the thread it lives on
+    for (const Session& session : m_sessions)
+        session.serial->deleteLater();
+    m_sessions.clear();
+}
+
+bool GangProgrammer::start(const QStringList &ports, qint32 baudRate, const HexFile &image, bool doFlash,
+                           bool skipErased, int connectionTimeout)
+{
+    if (isRunning() || ports.isEmpty())
+        return false;
+    releaseSessions();
+
+    // every session copies this HexFile, which only shares its segments
+    m_image = image;
+    m_doFlash = doFlash;
+    m_skipErased = skipErased;
+    m_running = ports.size();
+    m_succeeded = 0;
+    m_failed = 0;
+
+    for (int i = 0; i < ports.size(); ++i)
+    {
+        Serial* serial = new Serial;
+        serial->moveToThread(m_threads[i % m_threads.size()]);
+        m_sessions.append({ports[i], serial, State::Connecting});
+
+        // events still queued from an earlier run must not reach a new session
+        connect(serial, &Serial::connected, this, [this, i, serial](bool ok, const QString &msg) {
+            if (!isCurrent(i, serial) || m_sessions[i].state != State::Connecting)
+                return;
+            Session& session = m_sessions[i];
+            if (!ok)
+            {
+                finishSession(i, false, msg);
+                return;
+            }
+            session.state = State::Programming;
+            emit portConnected(session.port, msg);
+            const HexFile image = m_image;
+            const bool doFlash = m_doFlash;
+            const bool skipErased = m_skipErased;
+            QMetaObject::invokeMethod(serial, [=]() { serial->program(image, doFlash, skipErased); }, Qt::QueuedConnection);
+        });
+        connect(serial, &Serial::uploadedProgress, this, [this, i, serial](int progress) {
+            if (isCurrent(i, serial))
+                emit portProgress(m_sessions[i].port, progress);
+        });
+        connect(serial, &Serial::firmwareUploaded, this, [this, i, serial](bool ok, const QString &msg) {
+            if (!isCurrent(i, serial) || m_sessions[i].state != State::Programming)
+                return;
+            // start the application only on a good image; a failed board
+            // stays in the bootloader so it can be programmed again
+            if (ok)
+                QMetaObject::invokeMethod(serial, [serial]() { serial->disconnectFromBootloader(); }, Qt::QueuedConnection);
+            finishSession(i, ok, msg);
+        });
+
+        const QString port = ports[i];
+        QMetaObject::invokeMethod(serial, [=]() {
+            if (!serial->tryConnectToBootloader(port, baudRate, connectionTimeout))
+                emit serial->connected(false, "Error: Could not open port "+port);
+        }, Qt::QueuedConnection);
+    }
+    return true;
+}
+
+bool GangProgrammer::isCurrent(int index, const Serial* serial) const
+{
+    return index < m_sessions.size() && m_sessions[index].serial == serial;
+}
+
+void GangProgrammer::finishSession(int index, bool ok, const QString &msg)
+{
+    Session& session = m_sessions[index];
+    session.state = State::Done;
+    if (ok)
+        ++m_succeeded;
+    else
+        ++m_failed;
+    emit portFinished(session.port, ok, msg);
+    if (--m_running == 0)
+        emit finished(m_succeeded, m_failed);
+}
@@ -0,0 +1,67 @@
+#ifndef GANGPROGRAMMER_H
+#define GANGPROGRAMMER_H
+
+#include <QObject>
+#include <QStringList>
+#include <QThread>
+#include <QVector>
+
+#include "common/hexfile.h"
+
+class Serial;
+
+// Programs the same image into boards on many serial ports at once. Every
+// port gets its own Serial session; the sessions are spread over a small
+// pool of I/O threads and all share the one HexFile.
+class GangProgrammer : public QObject
+{
+    Q_OBJECT
+public:
+    // threads = 0 uses QThread::idealThreadCount()
+    explicit GangProgrammer(int threads = 0, QObject *parent = nullptr);
+    ~GangProgrammer();
+
+    // Connects, programs and starts the application on every port. Per port
+    // results arrive through portFinished(), then finished() once for all.
+    bool start(const QStringList &ports, qint32 baudRate, const HexFile &image, bool doFlash,
+               bool skipErased = false, int connectionTimeout = 2000);
+
+    bool isRunning() const {return m_running > 0;}
+    int threadCount() const {return m_threads.size();}
+
+signals:
+    void portConnected(const QString &port, const QString &msg);
+    void portProgress(const QString &port, int progress);
+    void portFinished(const QString &port, bool ok, const QString &msg);
+    void finished(int succeeded, int failed);
+
+private:
+    enum class State : quint8
+    {
+        Connecting,
+        Programming,
+        Done,
+    };
+
+    struct Session
+    {
+        QString port;
+        Serial* serial;
+        State state;
+    };
+
+    bool isCurrent(int index, const Serial* serial) const;
+    void finishSession(int index, bool ok, const QString &msg);
+    void releaseSessions();
+
+    QVector<QThread*> m_threads;
+    QVector<Session> m_sessions;
+    HexFile m_image;
+    bool m_doFlash = true;
+    bool m_skipErased = false;
+    int m_running = 0;
+    int m_succeeded = 0;
+    int m_failed = 0;
+};
+
+#endif // GANGPROGRAMMER_H
@@ -0,0 +1,115 @@
+#include "linesender.h"
+
+#include <QSerialPort>
+
+#include "common/uploadtrace.h"
+
+LineSender::LineSender(QSerialPort* port, QObject *parent)
+    : QObject(parent), m_port(port), m_encoder(HexFile())
+{
+}
+
+void LineSender::start(const HexEncoder& encoder)
+{
+    m_encoder = encoder;
+    m_encoder.rewind();
+    m_chunkLength = 0;
+    m_chunkOffset = 0;
+    m_sent = 0;
+    m_acked = 0;
+    m_unacked.clear();
+    m_stalled = 0;
+    m_paused = false;
+    m_active = true;
+    pump();
+}
+
+void LineSender::stop()
+{
+    m_active = false;
+    m_paused = false;
+    m_chunkLength = m_chunkOffset = 0;
+    m_sent = 0;
+    m_acked = 0;
+    m_unacked.clear();
+}
+
+void LineSender::acknowledge()
+{
+    if (!m_unacked.isEmpty())
+        m_acked += m_unacked.dequeue();
+    pump();
+}
+
+void LineSender::setPaused(bool paused)
+{
+    if (paused == m_paused)
+        return;
+    m_paused = paused;
+    if (paused)
+        m_stallTimer.start();
+    else
+    {
+        m_stalled += m_stallTimer.elapsed();
+        pump();
+    }
+}
+
+qint64 LineSender::inFlight() const
+{
+    return m_sent - m_acked;
+}
+
+bool LineSender::allQueued() const
+{
+    return m_chunkOffset == m_chunkLength && m_encoder.atEnd();
+}
+
+qint64 LineSender::stallTime() const
+{
+    return m_paused ? m_stalled + m_stallTimer.elapsed() : m_stalled;
+}
+
+bool LineSender::refill()
+{
+    m_chunkLength = m_encoder.next(m_record);
+    m_chunkOffset = 0;
+    return m_chunkLength > 0;
+}
+
+void LineSender::pump()
+{
+    if (!m_active || m_paused)
+        return;
+    for (;;)
+    {
+        if (m_chunkOffset == m_chunkLength && !refill())
+            break;
+        // The window counts everything the device has not acknowledged, so
+        // bytes sitting in the kernel or the USB bridge are included. A
+        // record longer than the window still goes out on its own.
+        qint64 room = m_highWaterMark - inFlight();
+        if (m_unacked.isEmpty())
+            room = qMax<qint64>(room, m_chunkLength - m_chunkOffset);
+        if (room <= 0)
+            break;
+        const int count = static_cast<int>(qMin<qint64>(room, m_chunkLength - m_chunkOffset));
+        const qint64 written = m_port->write(m_record + m_chunkOffset, count);
+        if (written < 0)
+        {
+            stop();
+            emit writeFailed();
+            return;
+        }
+        if (m_trace)
+            m_trace->record(UploadTrace::Event::Write, static_cast<quint32>(written));
+        m_chunkOffset += static_cast<int>(written);
+        m_sent += written;
+        if (m_chunkOffset == m_chunkLength)
+            m_unacked.enqueue(m_chunkLength);
+        if (written < count)
+            break;
+    }
+    if (allQueued() && m_port->bytesToWrite() == 0)
+        m_active = false;
+}
@@ -0,0 +1,80 @@
+#ifndef LINESENDER_H
+#define LINESENDER_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QQueue>
+
+#include "common/hexencoder.h"
+
+class QSerialPort;
+class UploadTrace;
+
+// Feeds records to the port while keeping at most highWaterMark() bytes
+// that the device has not acknowledged yet. Every acknowledgement returns
+// the credit of one record; the sender holds off while the device has sent
+// XOFF. Records are pulled from a HexEncoder one at a time as the window
+// opens.
+class LineSender : public QObject
+{
+    Q_OBJECT
+public:
+    explicit LineSender(QSerialPort* port, QObject *parent = nullptr);
+
+    // Only one encoded record is held at a time and the image is not walked
+    // in advance; the sender is done once the encoder is at its end
+    void start(const HexEncoder& encoder);
+    void stop();
+
+    // Writes are recorded here if set
+    void setTrace(UploadTrace* trace) {m_trace = trace;}
+
+    void setHighWaterMark(int bytes) {m_highWaterMark = qMax(bytes, 1);}
+    int highWaterMark() const {return m_highWaterMark;}
+
+    // Call for every XON/XOFF seen on the read side
+    void setPaused(bool paused);
+    // Call for every record the device has acknowledged
+    void acknowledge();
+    bool isPaused() const {return m_paused;}
+
+    bool isActive() const {return m_active;}
+    // Bytes handed to the port but not yet acknowledged by the device
+    qint64 inFlight() const;
+    // Bytes handed to the port since start()
+    qint64 sent() const {return m_sent;}
+    // True once every record has been handed to the port
+    bool allQueued() const;
+    // The streaming encoder, whose counts cover the records sent so far
+    const HexEncoder& encoder() const {return m_encoder;}
+    // Total time spent paused by XOFF since start()
+    qint64 stallTime() const;
+
+    // Writes as much as the window allows
+    void pump();
+
+signals:
+    void writeFailed();
+
+private:
+    bool refill();
+
+    QSerialPort* m_port;
+    UploadTrace* m_trace = nullptr;
+    HexEncoder m_encoder;
+    char m_record[HexEncoder::MAX_RECORD_LENGTH];
+    // Length of the current record and how much of it went to the port
+    int m_chunkLength = 0;
+    int m_chunkOffset = 0;
+    qint64 m_sent = 0;
+    qint64 m_acked = 0;
+    // lengths of the records handed to the port, oldest first
+    QQueue<int> m_unacked;
+    int m_highWaterMark = 256;
+    bool m_active = false;
+    bool m_paused = false;
+    QElapsedTimer m_stallTimer;
+    qint64 m_stalled = 0;
+};
+
+#endif // LINESENDER_H
@@ -1,11 +1,38 @@
 #include "mainwindow.h"
 
+#include <cstdio>
+#include <cstring>
+
 #include <QApplication>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QTimer>
+
+#include "cli.h"
+#include "processstats.h"
 
 int main(int argc, char *argv[])
 {
+    // Headless fixtures never pay for QApplication and the widgets
+    if (isCliInvocation(argc, argv))
+        return runCli(argc, argv);
+
+    QElapsedTimer startup;
+    startup.start();
+    bool stats = false;
+    for (int i = 1; i < argc; ++i)
+        stats = stats || strcmp(argv[i], "--stats") == 0;
+
     QApplication a(argc, argv);
     MainWindow w;
     w.show();
+    if (stats)
+    {
+        // first pass through the event loop, i.e. once the window is up
+        QTimer::singleShot(0, [&startup]() {
+            printf("%s\n", QJsonDocument(startupStats("gui", startup.nsecsElapsed())).toJson(QJsonDocument::Compact).constData());
+            fflush(stdout);
+        });
+    }
     return a.exec();
 }
@@ -1,39 +1,36 @@
 #include <QTimer>
-#include <QDebug>
-#include <QSerialPortInfo>
 #include <QMessageBox>
 #include <QFileDialog>
 #include <QCloseEvent>
 #include <QInputDialog>
+#include <QStandardPaths>
+#include <QtMath>
 
 #include "common/hexfile.h"
+#include "common/log.h"
+#include "portwatcher.h"
 #include "serial.h"
+#include "serialthread.h"
 
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
 
-void MainWindow::updatePorts()
+// Scrollback limit of the console
+static const int CONSOLE_MAX_LINES = 5000;
+
+void MainWindow::updatePorts(const QStringList &added, const QStringList &removed)
 {
     QString curr = ui->cmbPort->currentText();
-    //ui->cmbPort->clear();
-    foreach (const QSerialPortInfo &serialPortInfo, QSerialPortInfo::availablePorts())
+    for (const QString &port : removed)
     {
-        if (ui->cmbPort->findText(serialPortInfo.portName()) == -1)
-            ui->cmbPort->addItem(serialPortInfo.portName());
+        const int index = ui->cmbPort->findText(port);
+        if (index != -1)
+            ui->cmbPort->removeItem(index);
     }
-
-    for (auto i=0; i<ui->cmbPort->count(); i++)
+    for (const QString &port : added)
     {
-        bool found = false;
-        foreach (const QSerialPortInfo &serialPortInfo, QSerialPortInfo::availablePorts())
-        {
-            if (ui->cmbPort->itemText(i) == serialPortInfo.portName())
-                found = true;
-        }
-        if (found == false)
-        {
-            ui->cmbPort->removeItem(i);
-        }
+        if (ui->cmbPort->findText(port) == -1)
+            ui->cmbPort->addItem(port);
     }
     if (ui->cmbPort->findText(curr) != -1)
         ui->cmbPort->setCurrentText(curr);
@@ -42,6 +39,9 @@ void MainWindow::updatePorts()
 void MainWindow::initBaudRates()
 {
     QStringList baudList = {
+        "1000000",
+        "500000",
+        "250000",
         "230400",
         "115200",
         "76800",
@@ -57,24 +57,61 @@ void MainWindow::initBaudRates()
         "300",
         "150",
         "100",
+        tr("Auto"),
     };
     ui->baudRateBox->addItems(baudList);
+    // auto-probing is opt-in; keep the rate that always was the default
+    ui->baudRateBox->setCurrentText("230400");
 }
 
 void MainWindow::consoleOutput(QString line, MsgType type)
 {
-    QTextCursor cursor = ui->console->textCursor();
-    switch(type)
+    LOG_DEBUG("%s", qPrintable(line));
+    m_consolePending.append({line, type, false});
+    if (!m_consoleTimer->isActive())
+        m_consoleTimer->start();
+}
+
+void MainWindow::consoleProgress(int progress)
+{
+    const QString line = QString::number(progress)+"%";
+    if (!m_consolePending.isEmpty() && m_consolePending.last().progress)
+        m_consolePending.last().text = line;
+    else
+        m_consolePending.append({line, MsgType::Ok, true});
+    if (!m_consoleTimer->isActive())
+        m_consoleTimer->start();
+}
+
+void MainWindow::flushConsole()
+{
+    if (m_consolePending.isEmpty())
+        return;
+    for (const ConsoleLine& line : m_consolePending)
     {
-        case MsgType::Alert: ui->console->setTextColor(Qt::darkRed); break;
-        case MsgType::Ok: ui->console->setTextColor(Qt::darkGreen); break;
-        default: ui->console->setTextColor(Qt::black); break;
+        if (line.progress && m_consoleEndsWithProgress)
+        {
+            // rewrite the previous progress line instead of adding one
+            QTextCursor cursor(ui->console->document());
+            cursor.movePosition(QTextCursor::End);
+            cursor.movePosition(QTextCursor::StartOfBlock, QTextCursor::KeepAnchor);
+            cursor.insertText(line.text);
+            continue;
+        }
+        switch(line.type)
+        {
+            case MsgType::Alert: ui->console->setTextColor(Qt::darkRed); break;
+            case MsgType::Ok: ui->console->setTextColor(Qt::darkGreen); break;
+            default: ui->console->setTextColor(Qt::black); break;
+        }
+        ui->console->append(line.text);
+        m_consoleEndsWithProgress = line.progress;
     }
-    ui->console->append(line);
+    QTextCursor cursor = ui->console->textCursor();
     cursor.movePosition(QTextCursor::End);
     ui->console->setTextCursor(cursor);
-    statusBar()->showMessage(line);
-    qDebug()<<line;
+    statusBar()->showMessage(m_consolePending.last().text);
+    m_consolePending.clear();
 }
 
 void MainWindow::on_baudRateCustom(const QString &baudRate)
@@ -87,24 +124,22 @@ void MainWindow::on_connect()
 {
     if (!m_port->isOpen())
     {
-        int baudRate = ui->baudRateBox->currentText().toInt();
-        if (baudRate == 0)
+        const bool autoBaud = ui->baudRateBox->currentText() == tr("Auto");
+        int baudRate = autoBaud ? Serial::AUTO_BAUD : ui->baudRateBox->currentText().toInt();
+        if (baudRate == 0 && !autoBaud)
         {
             QMessageBox::warning(this, "Error", "Wrong baudrate");
             return;
         }
-        if (!m_port->tryConnectToBootloader(this->ui->cmbPort->currentText(), baudRate, ui->timeoutBox->value()))
-        {
-            QMessageBox::warning(this, "Error", tr("Could not connect to port"));
-            return;
-        }
-        m_port_timer->stop();
+        // failure to open the port is reported through on_connected
+        m_port->tryConnectToBootloader(this->ui->cmbPort->currentText(), baudRate, ui->timeoutBox->value());
+        m_portWatcher->stop();
         ui->cmbPort->setEnabled(false);
         ui->baudRateBox->setEnabled(false);
         ui->connectButton->setText("Connecting...");
         ui->connectButton->setEnabled(false);
         ui->timeoutBox->setEnabled(false);
-        consoleOutput(tr("Connecting to ")+m_port->portName()+"...");
+        consoleOutput(tr("Connecting to ")+ui->cmbPort->currentText()+"...");
     }
     else
     {
@@ -121,6 +156,7 @@ void MainWindow::on_connected(bool is_connected, const QString &msg)
         ui->timeoutBox->setEnabled(false);
         ui->programButton->setEnabled(true);
         ui->programEepromButton->setEnabled(true);
+        ui->programAllButton->setEnabled(true);
         ui->eraseFlashButton->setEnabled(true);
         ui->eraseEepromButton->setEnabled(true);
         ui->progressBar->setEnabled(true);
@@ -129,10 +165,11 @@ void MainWindow::on_connected(bool is_connected, const QString &msg)
     }
     else
     {
+        m_runningJobs = false;
         ui->connectButton->setText("Connect");
         ui->connectButton->setEnabled(true);
         ui->timeoutBox->setEnabled(true);
-        m_port_timer->start();
+        m_portWatcher->start();
         ui->cmbPort->setEnabled(true);
         ui->baudRateBox->setEnabled(true);
         ui->hexFilePath->setEnabled(true);
@@ -141,6 +178,7 @@ void MainWindow::on_connected(bool is_connected, const QString &msg)
         ui->selectEepromButton->setEnabled(true);
         ui->programButton->setEnabled(false);
         ui->programEepromButton->setEnabled(false);
+        ui->programAllButton->setEnabled(false);
         ui->eraseFlashButton->setEnabled(false);
         ui->eraseEepromButton->setEnabled(false);
         ui->progressBar->setEnabled(false);
@@ -152,6 +190,49 @@ void MainWindow::on_connected(bool is_connected, const QString &msg)
     }
 }
 
+void MainWindow::setProgrammingEnabled(bool enabled)
+{
+    ui->hexFilePath->setEnabled(enabled);
+    ui->eepromFilePath->setEnabled(enabled);
+    ui->selectHexButton->setEnabled(enabled);
+    ui->selectEepromButton->setEnabled(enabled);
+
+    ui->programButton->setEnabled(enabled);
+    ui->programEepromButton->setEnabled(enabled);
+    ui->programAllButton->setEnabled(enabled);
+    ui->eraseFlashButton->setEnabled(enabled);
+    ui->eraseEepromButton->setEnabled(enabled);
+    ui->connectButton->setEnabled(enabled);
+}
+
+void MainWindow::on_programAll_click()
+{
+    if (ui->hexFilePath->text().isEmpty() || ui->eepromFilePath->text().isEmpty())
+    {
+        QMessageBox::warning(this, "Error", tr("Both the flash hex file and the EEPROM file have to be specified"));
+        return;
+    }
+    HexFile flash;
+    HexFile eeprom;
+    m_imageCache.load(ui->hexFilePath->text(), false, flash, true);
+    m_imageCache.load(ui->eepromFilePath->text(), true, eeprom, true);
+    for (const HexFile* image : {&flash, &eeprom})
+    {
+        if (!image->errorString().isEmpty())
+        {
+            consoleOutput(image->errorString(), MsgType::Alert);
+            return;
+        }
+    }
+
+    setProgrammingEnabled(false);
+    m_runningJobs = true;
+    consoleOutput(QString("Image cache: %1 hits, %2 misses").arg(m_imageCache.hits()).arg(m_imageCache.misses()));
+    consoleOutput("Uploading firmware and eeprom to the chip...");
+    m_port->runJobs({Serial::Job::program(flash, true, ui->skipErasedPages->isChecked()),
+                     Serial::Job::program(eeprom, false)});
+}
+
 void MainWindow::on_program_click()
 {
     bool ok = false;
@@ -165,7 +246,7 @@ void MainWindow::on_program_click()
             QMessageBox::warning(this, "Error", tr("Flash hex file is not specified"));
             return;
         }
-        hexfile.load(ui->hexFilePath->text(), true);
+        m_imageCache.load(ui->hexFilePath->text(), false, hexfile, true);
         ok = true;
     }
     else if (caller == ui->programEepromButton)
@@ -175,34 +256,19 @@ void MainWindow::on_program_click()
             QMessageBox::warning(this, "Error", tr("EEPROM file is not specified"));
             return;
         }
-        hexfile.load(ui->eepromFilePath->text(), true);
+        m_imageCache.load(ui->eepromFilePath->text(), true, hexfile, true);
         ok = true;
     }
     else if (caller == ui->eraseFlashButton)
     {
         size = QInputDialog::getInt(this, tr("Flash size"),
                                          tr("Enter available flash size in kb:"), 0, 0, 256, 1, &ok);
-
-        if (ok)
-        {
-            for (int i = 0; i < (size)*1024; i++)
-            {
-                hexfile.append(0xFF);
-            }
-        }
+        size *= 1024;
     }
     else if (caller == ui->eraseEepromButton)
     {
         size = QInputDialog::getInt(this, tr("Eeprom size"),
                                          tr("Enter EEPROM size in bytes:"), 0, 0, 4096, 1, &ok);
-
-        if (ok)
-        {
-            for (int i = 0; i < size; i++)
-            {
-                hexfile.append(0xFF);
-            }
-        }
     }
     if (!hexfile.errorString().isEmpty())
     {
@@ -212,21 +278,15 @@ void MainWindow::on_program_click()
 
     if (ok)
     {
-        ui->hexFilePath->setEnabled(false);
-        ui->eepromFilePath->setEnabled(false);
-        ui->selectHexButton->setEnabled(false);
-        ui->selectEepromButton->setEnabled(false);
+        setProgrammingEnabled(false);
 
-        ui->programButton->setEnabled(false);
-        ui->programEepromButton->setEnabled(false);
-        ui->eraseFlashButton->setEnabled(false);
-        ui->eraseEepromButton->setEnabled(false);
-        ui->connectButton->setEnabled(false);
+        if (caller == ui->programButton || caller == ui->programEepromButton)
+            consoleOutput(QString("Image cache: %1 hits, %2 misses").arg(m_imageCache.hits()).arg(m_imageCache.misses()));
 
         if (caller == ui->programButton)
         {
             consoleOutput("Uploading firmware to the chip...");
-            m_port->program(hexfile, true);
+            m_port->program(hexfile, true, ui->skipErasedPages->isChecked());
         }
         else if (caller == ui->programEepromButton)
         {
@@ -241,12 +301,12 @@ void MainWindow::on_program_click()
         else if (caller == ui->eraseFlashButton)
         {
             consoleOutput("Erasing the chip...");
-            m_port->program(hexfile, true);
+            m_port->erase(static_cast<quint32>(size), true);
         }
         else if (caller == ui->eraseEepromButton)
         {
             consoleOutput("Erasing EEPROM...");
-            m_port->program(hexfile, false);
+            m_port->erase(static_cast<quint32>(size), false);
         }
     }
 }
@@ -256,16 +316,24 @@ MainWindow::MainWindow(QWidget *parent)
     , ui(new Ui::MainWindow)
 {
     ui->setupUi(this);
+    // old lines fall off the top once the scrollback is full
+    ui->console->document()->setMaximumBlockCount(CONSOLE_MAX_LINES);
+    m_consoleTimer = new QTimer(this);
+    m_consoleTimer->setSingleShot(true);
+    m_consoleTimer->setInterval(16);
+    connect(m_consoleTimer, &QTimer::timeout, this, &MainWindow::flushConsole);
     this->setFixedSize(this->width(),this->height());
-    m_port_timer = new QTimer(this);
-    connect(m_port_timer, &QTimer::timeout, this, &MainWindow::updatePorts);
-    m_port_timer->start(400);
-    foreach (const QSerialPortInfo &serialPortInfo, QSerialPortInfo::availablePorts())
-    {
-            ui->cmbPort->addItem(serialPortInfo.portName());
-    }
-    m_port = new Serial(this);
-    connect(m_port, &Serial::connected, this, &MainWindow::on_connected);
+    m_portWatcher = new PortWatcher(this);
+    connect(m_portWatcher, &PortWatcher::portsChanged, this, &MainWindow::updatePorts);
+    m_portWatcher->start();
+    m_port = new SerialThread(this);
+    connect(m_port, &SerialThread::connected, this, &MainWindow::on_connected);
+    connect(m_port, &SerialThread::baudRateDetected, [=](qint32 baudRate){
+        consoleOutput(tr("Detected baud rate: ")+QString::number(baudRate));
+    });
+    connect(m_port, &SerialThread::handshakeCompleted, [=](qint64 latencyNs, int probes){
+        consoleOutput(tr("Handshake took %1 ms (%2 probes)").arg(latencyNs / 1e6, 0, 'f', 1).arg(probes));
+    });
     connect(ui->connectButton, &QPushButton::clicked, this, &MainWindow::on_connect);
     connect(ui->baudRateBox, &QComboBox::editTextChanged, this, &MainWindow::on_baudRateCustom);
     connect(ui->displayConsole, &QCheckBox::toggled, [=](bool toggled){
@@ -287,12 +355,13 @@ MainWindow::MainWindow(QWidget *parent)
     });
     connect(ui->consoleClearButton, &QPushButton::clicked, [=](){
         ui->console->clear();
+        m_consoleEndsWithProgress = false;
     });
     connect(ui->selectHexButton, &QPushButton::clicked, [=](){
         ui->hexFilePath->setText(
                     QFileDialog::getOpenFileName(
                         this,
-                        tr("Select Flash Hex File"), "", tr("Hex Files (*.hex)")
+                        tr("Select Flash Image"), "", tr("Flash Images (*.hex *.bin *.elf);;Hex Files (*.hex);;Binary Files (*.bin);;ELF Files (*.elf)")
                     )
         );
     });
@@ -300,7 +369,7 @@ MainWindow::MainWindow(QWidget *parent)
         ui->eepromFilePath->setText(
                     QFileDialog::getOpenFileName(
                         this,
-                        tr("Select EEPROM Hex File"), "", tr("Hex Files (*.eep)")
+                        tr("Select EEPROM Image"), "", tr("EEPROM Images (*.eep *.hex *.bin *.elf);;Hex Files (*.eep *.hex);;Binary Files (*.bin);;ELF Files (*.elf)")
                     )
         );
     });
@@ -308,21 +377,21 @@ MainWindow::MainWindow(QWidget *parent)
     connect(ui->programEepromButton, &QPushButton::clicked, this, &MainWindow::on_program_click);
     connect(ui->eraseFlashButton, &QPushButton::clicked, this, &MainWindow::on_program_click);
     connect(ui->eraseEepromButton, &QPushButton::clicked, this, &MainWindow::on_program_click);
-    connect(m_port, &Serial::uploadedProgress, [=](int val){
+    connect(ui->programAllButton, &QPushButton::clicked, this, &MainWindow::on_programAll_click);
+    connect(m_port, &SerialThread::uploadedProgress, [=](int val, qint64 bytesPerSecond, qint64 etaMs){
+        if (etaMs > 0)
+            ui->progressBar->setFormat(tr("%p% - %1 kB/s, %2 s left").arg(bytesPerSecond / 1000.0, 0, 'f', 1)
+                                                                    .arg(qCeil(etaMs / 1000.0)));
+        else
+            ui->progressBar->setFormat("%p%");
         ui->progressBar->setValue(val);
-        consoleOutput(QString::number(val)+"%");
+        consoleProgress(val);
     });
-    connect(m_port, &Serial::firmwareUploaded, [=](bool val, const QString &msg){
-        ui->hexFilePath->setEnabled(true);
-        ui->eepromFilePath->setEnabled(true);
-        ui->selectHexButton->setEnabled(true);
-        ui->selectEepromButton->setEnabled(true);
-
-        ui->programButton->setEnabled(true);
-        ui->programEepromButton->setEnabled(true);
-        ui->eraseFlashButton->setEnabled(true);
-        ui->eraseEepromButton->setEnabled(true);
-        ui->connectButton->setEnabled(true);
+    connect(m_port, &SerialThread::firmwareUploaded, [=](bool val, const QString &msg){
+        // a job run re-enables them once its last step is done
+        if (!m_runningJobs)
+            setProgrammingEnabled(true);
+        ui->progressBar->setFormat("%p%");
 
         if (val)
             consoleOutput("Finished! "+msg);
@@ -335,7 +404,21 @@ MainWindow::MainWindow(QWidget *parent)
                 consoleOutput(msg, MsgType::Alert);
         }
     });
+    connect(m_port, &SerialThread::jobStarted, [=](int index, int count){
+        consoleOutput(QString("Step %1 of %2").arg(index + 1).arg(count));
+    });
+    connect(m_port, &SerialThread::jobsFinished, [=](bool val){
+        // a lost connection has already reset the window
+        if (!m_runningJobs)
+            return;
+        m_runningJobs = false;
+        setProgrammingEnabled(true);
+        // a failed step has reported its own error
+        if (val)
+            consoleOutput("All steps finished");
+    });
     initBaudRates();
+    m_imageCache.setCacheDirectory(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+"/images");
 }
 
 MainWindow::~MainWindow()
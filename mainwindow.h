@@ -3,13 +3,17 @@
 
 #include <QMainWindow>
 #include <QSerialPort>
+#include <QVector>
+
+#include "common/imagecache.h"
 
 QT_BEGIN_NAMESPACE
 namespace Ui { class MainWindow; }
 QT_END_NAMESPACE
 
 class QTimer;
-class Serial;
+class PortWatcher;
+class SerialThread;
 
 class MainWindow : public QMainWindow
 {
@@ -29,16 +33,36 @@ private:
         Alert,
     };
 
-    void updatePorts();
+    void updatePorts(const QStringList &added, const QStringList &removed);
     void initBaudRates();
+    // Console lines are buffered and flushed at most once per frame
     void consoleOutput(QString line, MsgType type = MsgType::Ok);
+    // Collapsed into a single line that is updated in place
+    void consoleProgress(int progress);
+    void flushConsole();
     void on_baudRateCustom(const QString &baudRate);
     void on_connect();
     void on_connected(bool, const QString &msg);
     void on_program_click();
+    // Flash and EEPROM back to back in one bootloader session
+    void on_programAll_click();
+    void setProgrammingEnabled(bool enabled);
+
+    struct ConsoleLine
+    {
+        QString text;
+        MsgType type;
+        bool progress;
+    };
+
+    QVector<ConsoleLine> m_consolePending;
+    QTimer* m_consoleTimer;
+    bool m_consoleEndsWithProgress = false;
 
-    QTimer* m_port_timer;
-    Serial* m_port;
+    ImageCache m_imageCache;
+    PortWatcher* m_portWatcher;
+    SerialThread* m_port;
+    bool m_runningJobs = false;
     Ui::MainWindow *ui;
 };
 #endif // MAINWINDOW_H
@@ -0,0 +1,162 @@
+#include "portwatcher.h"
+
+#include <QFileSystemWatcher>
+#include <QSerialPortInfo>
+#include <QSocketNotifier>
+#include <QTimer>
+
+#ifdef Q_OS_LINUX
+#include <cstring>
+
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "common/log.h"
+
+// Coalesces bursts of events
+static const int RESCAN_DELAY = 20;
+// Kernel uevents arrive before udev has created or chmod'ed the node, so
+// every burst is followed by a second look once udev is done
+static const int SETTLE_DELAY = 250;
+// Only used when neither uevents nor inotify are available
+static const int POLL_INTERVAL = 1000;
+
+PortWatcher::PortWatcher(QObject *parent) : QObject(parent)
+{
+    m_debounce = new QTimer(this);
+    m_debounce->setSingleShot(true);
+    m_debounce->setInterval(RESCAN_DELAY);
+    connect(m_debounce, &QTimer::timeout, this, &PortWatcher::rescan);
+    m_settle = new QTimer(this);
+    m_settle->setSingleShot(true);
+    m_settle->setInterval(SETTLE_DELAY);
+    connect(m_settle, &QTimer::timeout, this, &PortWatcher::rescan);
+
+    if (openUevents())
+        LOG_DEBUG("Watching serial ports through kernel uevents");
+    else
+    {
+        m_fsWatcher = new QFileSystemWatcher(this);
+        if (m_fsWatcher->addPath("/dev"))
+        {
+            connect(m_fsWatcher, &QFileSystemWatcher::directoryChanged, this, &PortWatcher::scheduleRescan);
+            LOG_DEBUG("Watching serial ports through /dev");
+        }
+        else
+        {
+            m_poll = new QTimer(this);
+            m_poll->setInterval(POLL_INTERVAL);
+            connect(m_poll, &QTimer::timeout, this, &PortWatcher::rescan);
+            LOG_DEBUG("Polling serial ports");
+        }
+    }
+}
+
+PortWatcher::~PortWatcher()
+{
+#ifdef Q_OS_LINUX
+    if (m_netlink >= 0)
+        ::close(m_netlink);
+#endif
+}
+
+bool PortWatcher::openUevents()
+{
+#ifdef Q_OS_LINUX
+    m_netlink = ::socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (m_netlink < 0)
+        return false;
+    sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = 1;  // kernel events
+    if (::bind(m_netlink, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        ::close(m_netlink);
+        m_netlink = -1;
+        return false;
+    }
+    m_notifier = new QSocketNotifier(m_netlink, QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &PortWatcher::readUevents);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void PortWatcher::readUevents()
+{
+#ifdef Q_OS_LINUX
+    // "ACTION@DEVPATH\0KEY=VALUE\0..."; only the tty subsystem matters
+    char buffer[8192];
+    bool relevant = false;
+    for (;;)
+    {
+        const ssize_t length = ::recv(m_netlink, buffer, sizeof(buffer) - 1, 0);
+        if (length <= 0)
+            break;
+        buffer[length] = 0;
+        for (const char* field = buffer; field < buffer + length; field += strlen(field) + 1)
+        {
+            if (strcmp(field, "SUBSYSTEM=tty") == 0 || strcmp(field, "SUBSYSTEM=usb-serial") == 0)
+                relevant = true;
+        }
+    }
+    if (relevant)
+        scheduleRescan();
+#endif
+}
+
+void PortWatcher::start()
+{
+    m_active = true;
+    if (m_poll)
+        m_poll->start();
+    rescan();
+}
+
+void PortWatcher::stop()
+{
+    m_active = false;
+    m_debounce->stop();
+    m_settle->stop();
+    if (m_poll)
+        m_poll->stop();
+}
+
+QStringList PortWatcher::ports() const
+{
+    QStringList result = m_ports.values();
+    result.sort();
+    return result;
+}
+
+void PortWatcher::scheduleRescan()
+{
+    if (m_active)
+    {
+        m_debounce->start();
+        m_settle->start();
+    }
+}
+
+void PortWatcher::rescan()
+{
+    if (!m_active)
+        return;
+    // one enumeration per event
+    QSet<QString> current;
+    for (const QSerialPortInfo &info : QSerialPortInfo::availablePorts())
+        current.insert(info.portName());
+    if (current == m_ports)
+        return;
+
+    QStringList added = (current - m_ports).values();
+    QStringList removed = (m_ports - current).values();
+    added.sort();
+    removed.sort();
+    m_ports = current;
+    emit portsChanged(added, removed);
+}
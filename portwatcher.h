@@ -0,0 +1,52 @@
+#ifndef PORTWATCHER_H
+#define PORTWATCHER_H
+
+#include <QObject>
+#include <QSet>
+#include <QStringList>
+
+class QFileSystemWatcher;
+class QSocketNotifier;
+class QTimer;
+
+// Reports serial ports appearing and disappearing. On Linux it listens for
+// kernel uevents of the tty subsystem (netlink), falling back to inotify on
+// /dev and finally to slow polling. A burst of events leads to one
+// enumeration right away and one after udev has settled, each diffed against
+// the previous one.
+class PortWatcher : public QObject
+{
+    Q_OBJECT
+public:
+    explicit PortWatcher(QObject *parent = nullptr);
+    ~PortWatcher();
+
+    // start() rescans right away, so the first portsChanged() after
+    // construction lists every port as added; while stopped no signals are
+    // emitted
+    void start();
+    void stop();
+    bool isActive() const {return m_active;}
+
+    QStringList ports() const;
+
+signals:
+    void portsChanged(const QStringList &added, const QStringList &removed);
+
+private:
+    bool openUevents();
+    void readUevents();
+    void scheduleRescan();
+    void rescan();
+
+    int m_netlink = -1;
+    QSocketNotifier* m_notifier = nullptr;
+    QFileSystemWatcher* m_fsWatcher = nullptr;
+    QTimer* m_debounce;
+    QTimer* m_settle;
+    QTimer* m_poll = nullptr;
+    QSet<QString> m_ports;
+    bool m_active = false;
+};
+
+#endif // PORTWATCHER_H
@@ -0,0 +1,31 @@
+#include "processstats.h"
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+qint64 peakRssKiB()
+{
+#ifdef Q_OS_UNIX
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+#ifdef Q_OS_MACOS
+        return usage.ru_maxrss / 1024;  // bytes there
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+#endif
+    return -1;
+}
+
+QJsonObject startupStats(const char *mode, qint64 startupNs)
+{
+    return {
+        {"event", "stats"},
+        {"mode", mode},
+        {"startupMs", startupNs / 1e6},
+        {"peakRssKiB", static_cast<double>(peakRssKiB())},
+    };
+}
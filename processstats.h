@@ -0,0 +1,12 @@
+#ifndef PROCESSSTATS_H
+#define PROCESSSTATS_H
+
+#include <QJsonObject>
+
+// Peak resident set size of this process in KiB, -1 where unsupported
+qint64 peakRssKiB();
+
+// {"event":"stats","mode":mode,"startupMs":...,"peakRssKiB":...}
+QJsonObject startupStats(const char *mode, qint64 startupNs);
+
+#endif // PROCESSSTATS_H
@@ -0,0 +1,57 @@
+#include "progressmeter.h"
+
+#include <QtGlobal>
+
+void ProgressMeter::start(int total, qint64 totalBytes)
+{
+    m_total = total;
+    m_totalBytes = totalBytes;
+    m_done = 0;
+    m_bytesDone = 0;
+    m_elapsed = 0;
+    m_percent = 0;
+    m_reportedPercent = -1;
+    m_reportedAt = 0;
+    m_clock.start();
+}
+
+bool ProgressMeter::update(int done, qint64 bytesDone)
+{
+    m_done = done;
+    m_bytesDone = bytesDone;
+    m_elapsed = m_clock.elapsed();
+    m_percent = m_total > 0 ? qMin(100, qRound(done * 100.0 / m_total)) : 100;
+    if (m_percent == m_reportedPercent)
+        return false;
+    if (m_percent < 100 && (m_percent - m_reportedPercent < m_minStep
+                            || (m_reportedPercent >= 0 && m_elapsed - m_reportedAt < m_minInterval)))
+        return false;
+    m_reportedPercent = m_percent;
+    m_reportedAt = m_elapsed;
+    return true;
+}
+
+bool ProgressMeter::finish()
+{
+    m_elapsed = m_clock.elapsed();
+    m_done = m_total;
+    m_bytesDone = m_totalBytes;
+    m_percent = 100;
+    if (m_reportedPercent == 100)
+        return false;
+    m_reportedPercent = 100;
+    m_reportedAt = m_elapsed;
+    return true;
+}
+
+qint64 ProgressMeter::bytesPerSecond() const
+{
+    return m_elapsed > 0 ? m_bytesDone * 1000 / m_elapsed : 0;
+}
+
+qint64 ProgressMeter::etaMs() const
+{
+    if (m_done <= 0)
+        return -1;
+    return m_elapsed * (m_total - qMin(m_done, m_total)) / m_done;
+}
@@ -0,0 +1,53 @@
+#ifndef PROGRESSMETER_H
+#define PROGRESSMETER_H
+
+#include <QElapsedTimer>
+
+// Decides when upload progress is worth reporting. A report needs the
+// percentage to have moved by minStep() and minInterval() to have passed
+// since the last one, so the number of reports per job is bounded no matter
+// how small the pages or how fast the line; the final 100% always goes out.
+class ProgressMeter
+{
+public:
+    static const int DEFAULT_MIN_INTERVAL = 100;
+    static const int DEFAULT_MIN_STEP = 1;
+
+    // total acknowledgements (pages or records) and bytes on the line
+    void start(int total, qint64 totalBytes);
+    // Replaces estimated totals with exact ones while running
+    void setTotal(int total, qint64 totalBytes) {m_total = total; m_totalBytes = totalBytes;}
+
+    // Returns true if done/bytesDone should be reported
+    bool update(int done, qint64 bytesDone);
+    // Returns true if 100% has not been reported yet
+    bool finish();
+
+    void setMinInterval(int ms) {m_minInterval = ms;}
+    int minInterval() const {return m_minInterval;}
+    void setMinStep(int percent) {m_minStep = percent;}
+    int minStep() const {return m_minStep;}
+
+    qint64 totalBytes() const {return m_totalBytes;}
+
+    // As of the last update()
+    int percent() const {return m_percent;}
+    qint64 bytesPerSecond() const;
+    // Estimated time left, -1 before the first acknowledgement
+    qint64 etaMs() const;
+
+private:
+    QElapsedTimer m_clock;
+    int m_minInterval = DEFAULT_MIN_INTERVAL;
+    int m_minStep = DEFAULT_MIN_STEP;
+    int m_total = 0;
+    qint64 m_totalBytes = 0;
+    int m_done = 0;
+    qint64 m_bytesDone = 0;
+    qint64 m_elapsed = 0;
+    int m_percent = 0;
+    int m_reportedPercent = -1;
+    qint64 m_reportedAt = 0;
+};
+
+#endif // PROGRESSMETER_H
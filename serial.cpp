@@ -1,24 +1,68 @@
 #include "serial.h"
 
+#include <cstring>
+
 #include <QTimer>
 #include <QTime>
 #include <QChar>
-#include <QDebug>
 #include <QThread>
 #include <QtMath>
+#include <QSerialPortInfo>
+#include <QSettings>
+
+#include "common/hexencoder.h"
+#include "common/log.h"
+#include "linesender.h"
+
+static const quint32 FLASH_PAGE_SIZE = 128;
+// "UUUU\n" plus the banner, prompt and line ends the bootloader answers with
+static const int PROBE_EXCHANGE_BYTES = 5 + 32;
+// Longest a queued job step may go without hearing from the bootloader
+static const int JOB_STEP_TIMEOUT = 5000;
+// Largest image HexFile accepts, so the largest erase
+static const quint32 MAX_ERASE_BYTES = 262144;
+
+const qint32 Serial::AUTO_BAUD;
+const int Serial::AUTO_BAUD_TIMEOUT;
+const QList<qint32> Serial::AUTO_BAUD_RATES = {
+    1000000, 500000, 250000, 230400, 115200, 76800, 57600, 38400, 28800, 19200, 14400, 9600,
+};
+
+// Winning auto-baud rates, per port and USB serial number. QSettings is only
+// reentrant and sessions may run on several threads, so no shared instance.
+static qint32 cachedBaudRate(const QString& key)
+{
+    QSettings settings(QSettings::IniFormat, QSettings::UserScope, "c45b", "c45b-gui");
+    return settings.value(key).toInt();
+}
+
+static void storeBaudRate(const QString& key, qint32 baudRate)
+{
+    QSettings settings(QSettings::IniFormat, QSettings::UserScope, "c45b", "c45b-gui");
+    settings.setValue(key, baudRate);
+}
 
 Serial::Serial(QObject *parent) : QObject(parent)
 {
     m_connectTimer = new QTimer(this);
+    m_connectTimer->setSingleShot(true);
     m_uploadTimer = new QTimer(this);
     m_uploadTimer->setSingleShot(true);
     connect(m_connectTimer, &QTimer::timeout, this, &Serial::on_tryConnectTimeout);
     connect(m_uploadTimer, &QTimer::timeout, this, &Serial::on_uploadTimeout);
+    m_jobTimer = new QTimer(this);
+    m_jobTimer->setSingleShot(true);
+    m_jobTimer->setInterval(JOB_STEP_TIMEOUT);
+    connect(m_jobTimer, &QTimer::timeout, this, &Serial::on_jobTimeout);
     m_port = new QSerialPort(this);
     connect(m_port, &QSerialPort::readyRead, this, &Serial::handleReadyRead);
     connect(m_port, &QSerialPort::bytesWritten, this, &Serial::handleBytesWritten);
     connect(m_port, &QSerialPort::errorOccurred, this, &Serial::handleError);
-    connect(this, &Serial::do_parse, this, &Serial::parse, Qt::QueuedConnection);
+    m_sender = new LineSender(m_port, this);
+    m_sender->setTrace(&m_trace);
+    connect(m_sender, &LineSender::writeFailed, this, [this]() {
+        finishUpload(false, "Error: Failed to download hex file");
+    });
 }
 
 Serial::~Serial()
@@ -30,23 +74,111 @@ bool Serial::tryConnectToBootloader(QString port, qint32 baudRate, int connectio
 {
     m_connectionTimeout = connectionTimeout;
     m_port->setPortName(port);
+    m_autoBaud = baudRate == AUTO_BAUD;
+    m_baudCandidates.clear();
+    if (m_autoBaud)
+    {
+        m_connectionTimeout = qMin(connectionTimeout, AUTO_BAUD_TIMEOUT);
+        m_baudCandidates = AUTO_BAUD_RATES;
+        const qint32 cached = cachedBaudRate(baudRateCacheKey());
+        if (cached > 0)
+        {
+            m_baudCandidates.removeAll(cached);
+            m_baudCandidates.prepend(cached);
+        }
+        baudRate = m_baudCandidates.takeFirst();
+    }
     m_port->setBaudRate(baudRate);
-    m_port->setFlowControl(QSerialPort::SoftwareControl);
+    // XON/XOFF are handled by LineSender, whose window is bounded by record
+    // acknowledgements, so at most highWaterMark() bytes can still arrive
+    // after XOFF. With SoftwareControl some drivers consume XON/XOFF before
+    // they reach consume().
+    m_port->setFlowControl(QSerialPort::NoFlowControl);
     m_port->setParity(QSerialPort::NoParity);
     m_port->setDataBits(QSerialPort::Data8);
     m_port->setStopBits(QSerialPort::TwoStop);
     if (!m_port->open(QIODevice::ReadWrite)) {
-        qDebug()<<"Could not open port";
+        LOG_WARNING("Could not open port %s: %s", qPrintable(port), qPrintable(m_port->errorString()));
         return false;
     }
-    m_connectTimer->start(100);
+    m_trace.record(UploadTrace::Event::ConnectStart);
+    m_connected = false;
+    m_activeBootloader = false;
+    m_probes = 0;
+    m_connectClock.start();
+    startProbing();
     return true;
 }
 
+void Serial::setConnectBackoff(int initialMs, int maxMs, qreal factor)
+{
+    m_resendInitial = qMax(1, initialMs);
+    m_resendMax = qMax(m_resendInitial, maxMs);
+    m_resendFactor = qMax<qreal>(1.0, factor);
+}
+
+// Time one probe and its reply take on the line (8N2, 11 bits per character)
+static int probeExchangeMs(qint32 baudRate)
+{
+    return baudRate > 0 ? qCeil(PROBE_EXCHANGE_BYTES * 11 * 1000.0 / baudRate) : 0;
+}
+
+void Serial::startProbing()
+{
+    m_connectState = ConnectState::Probing;
+    m_rateClock.start();
+    m_unansweredProbes = 0;
+    // At low rates a 20 ms resend goes out before the first reply can be
+    // back, so the first resend waits for at least two exchanges
+    m_resendInterval = qMax(m_resendInitial, 2 * probeExchangeMs(m_port->baudRate()));
+    sendProbe();
+}
+
+void Serial::sendProbe()
+{
+    // skipped while the previous probe is still being written
+    if (prepareCommandAndWrite(Commands::Connect, "UUUU\n"))
+    {
+        ++m_probes;
+        ++m_unansweredProbes;
+    }
+    const qint64 remaining = m_connectionTimeout - m_rateClock.elapsed();
+    m_connectTimer->start(static_cast<int>(qBound<qint64>(0, m_resendInterval, remaining)));
+    m_resendInterval = qMax(m_resendInterval, qMin(m_resendMax, qCeil(m_resendInterval * m_resendFactor)));
+}
+
+void Serial::stopConnecting(ConnectState state)
+{
+    m_connectTimer->stop();
+    m_connectState = state;
+}
+
+void Serial::completeHandshake()
+{
+    stopConnecting(ConnectState::Connected);
+    m_currentCommand = Commands::Idle;
+    m_replyLength = 0;
+    // Every probe has been answered, so none is still being written; a
+    // command sent from the connected() slot must not be refused for it
+    m_writeData.clear();
+    m_currentWriteCommand = Commands::Idle;
+    emit handshakeCompleted(m_handshakeNs, m_probes);
+
+    if (m_activeBootloader)
+    {
+        connected(true, "Warning: bootloader was already active - could not check for compatible version");
+    }
+    else
+    {
+        connected(true, "===WELCOME TO Bootloader "+m_banner.mid(5).simplified()+"===");
+    }
+}
+
 void Serial::disconnectFromBootloader()
 {
     if (m_port->isOpen())
     {
+        stopConnecting(ConnectState::Idle);
         prepareCommandAndWrite(Commands::Disconnect, "g\n");
         m_connected = false;
         m_activeBootloader = false;
@@ -54,11 +186,54 @@ void Serial::disconnectFromBootloader()
     }
 }
 
+bool Serial::tryNextBaudRate()
+{
+    if (m_baudCandidates.isEmpty())
+        return false;
+    m_port->clear();
+    m_replyLength = 0;
+    m_writeData.clear();
+    m_port->setBaudRate(m_baudCandidates.takeFirst());
+    LOG_INFO("Trying %d baud", m_port->baudRate());
+    startProbing();
+    return true;
+}
+
+QString Serial::baudRateCacheKey() const
+{
+    const QString serialNumber = QSerialPortInfo(m_port->portName()).serialNumber();
+    QString key = "baudRates/" + m_port->portName();
+    if (!serialNumber.isEmpty())
+        key += "_" + serialNumber;
+    return key.replace('\\', '_');
+}
+
 QString Serial::portName() const
 {
     return m_port->portName();
 }
 
+void Serial::setRecordLength(int bytes)
+{
+    m_recordLength = qBound(1, bytes, 255);
+}
+
+void Serial::setProgressThrottle(int minIntervalMs, int minStepPercent)
+{
+    m_progress.setMinInterval(qMax(0, minIntervalMs));
+    m_progress.setMinStep(qMax(1, minStepPercent));
+}
+
+qint64 Serial::inFlight() const
+{
+    return m_sender->inFlight();
+}
+
+qint64 Serial::stallTime() const
+{
+    return m_sender->stallTime();
+}
+
 bool Serial::isOpen() const
 {
     return m_port->isOpen();
@@ -75,20 +250,121 @@ void Serial::close() const
     m_port->close();
 }
 
-void Serial::program(const HexFile& hexFile, bool doFlash)
+void Serial::program(const HexFile& hexFile, bool doFlash, bool skipErased)
 {
     QString cmd(doFlash ? "pf\n" : "pe\n");
     m_doFlash = doFlash;
-    prepareCommandAndWrite(Commands::Program, cmd.toUtf8(), hexFile);
+    m_skipErased = skipErased && doFlash;
+    m_isErase = false;
+    if (!prepareCommandAndWrite(Commands::Program, cmd.toUtf8(), hexFile))
+    {
+        finishUpload(false, "Error: Could not send '"+cmd.trimmed()+"' command");
+        return;
+    }
     // Wait for "pf+\r"
 }
 
+void Serial::erase(quint32 size, bool doFlash)
+{
+    if (size > MAX_ERASE_BYTES)
+    {
+        finishUpload(false, QString("Erase size %1 exceeds %2 bytes").arg(size).arg(MAX_ERASE_BYTES));
+        return;
+    }
+    QString cmd(doFlash ? "pf\n" : "pe\n");
+    m_doFlash = doFlash;
+    m_skipErased = false;
+    m_isErase = true;
+    m_fill = FillRegion{0, size, HexFile::FILL_BYTE};
+    if (!prepareCommandAndWrite(Commands::Program, cmd.toUtf8(), HexFile()))
+        finishUpload(false, "Error: Could not send '"+cmd.trimmed()+"' command");
+}
+
+Serial::Job Serial::Job::program(const HexFile &image, bool doFlash, bool skipErased)
+{
+    Job job;
+    job.type = Type::Program;
+    job.doFlash = doFlash;
+    job.skipErased = skipErased;
+    job.image = image;
+    return job;
+}
+
+Serial::Job Serial::Job::erase(quint32 size, bool doFlash)
+{
+    Job job;
+    job.type = Type::Erase;
+    job.doFlash = doFlash;
+    job.size = size;
+    return job;
+}
+
+Serial::Job Serial::Job::startApplication()
+{
+    Job job;
+    job.type = Type::StartApplication;
+    return job;
+}
+
+void Serial::runJobs(const QList<Job> &jobs)
+{
+    if (!m_connected)
+    {
+        emit jobsFinished(false, "Error: Not connected to bootloader");
+        return;
+    }
+    m_jobs += jobs;
+    m_jobCount += jobs.size();
+    if (!m_runningJobs)
+    {
+        m_runningJobs = true;
+        startNextJob();
+    }
+}
+
+void Serial::startNextJob()
+{
+    if (m_jobs.isEmpty())
+    {
+        finishJobs(true);
+        return;
+    }
+    const Job job = m_jobs.takeFirst();
+    emit jobStarted(m_jobIndex++, m_jobCount);
+    m_jobTimer->start();
+    switch (job.type)
+    {
+    case Job::Type::Program:
+        program(job.image, job.doFlash, job.skipErased);
+        break;
+    case Job::Type::Erase:
+        erase(job.size, job.doFlash);
+        break;
+    case Job::Type::StartApplication:
+        if (!m_jobs.isEmpty())
+            LOG_WARNING("Dropping %d jobs queued after starting the application", m_jobs.size());
+        disconnectFromBootloader();
+        finishJobs(true);
+        break;
+    }
+}
+
+void Serial::finishJobs(bool ok, const QString &msg)
+{
+    m_jobTimer->stop();
+    m_jobs.clear();
+    m_jobIndex = 0;
+    m_jobCount = 0;
+    m_runningJobs = false;
+    emit jobsFinished(ok, msg);
+}
+
 void Serial::handleBytesWritten(qint64 bytes)
 {
-    qDebug()<<"bytes written: "<<bytes;
-    qDebug()<<"Data successfully sent to port: "<<m_writeData;
+    LOG_TRACE("%lld bytes written", static_cast<long long>(bytes));
     m_writeData.clear();
     m_currentWriteCommand = Commands::Idle;
+    m_sender->pump();
 //    if (m_port->bytesToWrite() == 0)
 //        {
 //            //m_bytesWritten = 0;
@@ -101,41 +377,143 @@ void Serial::handleBytesWritten(qint64 bytes)
 
 void Serial::handleReadyRead()
 {
-    if (m_port->bytesAvailable()<30)
+    // Every byte is consumed exactly once, straight out of a stack buffer
+    char buffer[256];
+    qint64 count;
+    while ((count = m_port->read(buffer, sizeof(buffer))) > 0)
     {
-        m_readData.append(m_port->readAll());
-        //qDebug()<<m_readData;
-        if (m_readData.contains('\r') or m_readData.contains(Serial::XON))
-        {
-            m_readData.chop(1);
-            m_port->clear();
-            m_port->flush();
-            emit do_parse(m_readData, QPrivateSignal());
-            m_readData.clear();
-        }
-        else if (m_currentCommand == Commands::DownloadLine)
-        {
-            //m_port->clear();
-            //m_port->flush();
-            emit do_parse(m_readData, QPrivateSignal());
-            m_readData.clear();
-        }
+        for (qint64 i = 0; i < count; ++i)
+            consume(buffer[i]);
+    }
+}
+
+void Serial::consume(char c)
+{
+    if (c == Serial::XOFF || c == Serial::XON)
+    {
+        m_trace.record(c == Serial::XOFF ? UploadTrace::Event::Xoff : UploadTrace::Event::Xon);
+        m_sender->setPaused(c == Serial::XOFF);
+    }
+
+    if (m_currentCommand == Commands::DownloadLine)
+    {
+        handleUploadReply(c);
+        return;
+    }
+
+    if (c == '\r' || (c == Serial::XON && m_replyLength > 0))
+    {
+        // the reply is only borrowed for the duration of the call
+        const int length = m_replyLength;
+        m_replyLength = 0;
+        handleReply(QByteArray::fromRawData(m_reply, length));
+        return;
+    }
+    // skip the prompt and line feed between replies
+    if (m_replyLength == 0 && (c == '>' || c == '\n'))
+        return;
+    if (m_replyLength == REPLY_CAPACITY)
+    {
+        // only the tail of an overlong reply matters
+        memmove(m_reply, m_reply + REPLY_CAPACITY / 2, REPLY_CAPACITY / 2);
+        m_replyLength = REPLY_CAPACITY / 2;
+    }
+    m_reply[m_replyLength++] = c;
+}
+
+void Serial::handleUploadReply(char c)
+{
+    // any sign of life restarts the step timeout
+    if (m_runningJobs)
+        m_jobTimer->start();
+    switch (c)
+    {
+    case '*':
+    {
+        // one '*' per page write; EEPROM records are acknowledged with it
+        m_uploadTimer->start(1000);
+        if (!m_doFlash)
+            m_sender->acknowledge();
+        m_count++;
+        m_trace.record(UploadTrace::Event::PageAck, m_count);
+        updateUploadTotals();
+        LOG_TRACE("page %d of %d", m_count, m_pageTotal);
+        const qint64 written = m_sender->sent() - m_sender->inFlight();
+        if (m_progress.update(m_count, written))
+            emit uploadedProgress(m_progress.percent(), m_progress.bytesPerSecond(), m_progress.etaMs());
+        break;
+    }
+    case '-':
+        LOG_ERROR("Bootloader reported an error after %d pages", m_count);
+        finishUpload(false, "Something went wrong during programming :(");
+        break;
+    case '\r':
+        finishUpload(true);
+        break;
+    case '.':
+        m_trace.record(UploadTrace::Event::RecordAck);
+        m_sender->acknowledge();
+        break;
+    default:
+        // flow control, line feeds and the prompt
+        break;
+    }
+}
+
+void Serial::updateUploadTotals()
+{
+    if (m_pageTotalExact || !m_sender->allQueued())
+        return;
+    // the encoder has counted pages and records on the way
+    const HexEncoder& encoder = m_sender->encoder();
+    m_pageTotal = m_doFlash ? encoder.pagesSoFar() : encoder.recordsSoFar();
+    m_pageTotalExact = true;
+    m_progress.setTotal(m_pageTotal, m_sender->sent());
+    LOG_DEBUG("bytes in hex: %lld, pages: %d", static_cast<long long>(m_sender->sent()), m_pageTotal);
+}
+
+void Serial::finishUpload(bool ok, const QString &msg)
+{
+    m_trace.record(ok ? UploadTrace::Event::UploadEnd : UploadTrace::Event::Error);
+    m_uploadTimer->stop();
+    m_count = 0;
+    m_sender->stop();
+    if (ok && m_progress.finish())
+        emit uploadedProgress(100, m_progress.bytesPerSecond(), 0);
+    if (!ok)
+    {
+        // drop what is still queued for the device, but never unread replies
+        m_port->clear(QSerialPort::Output);
     }
+    m_currentCommand = Commands::Idle;
+    emit firmwareUploaded(ok, msg);
+    if (!m_runningJobs)
+        return;
+    if (ok)
+        startNextJob();
+    else
+        finishJobs(false, msg);
 }
 
 void Serial::handleError(QSerialPort::SerialPortError serialPortError)
 {
     if (serialPortError == QSerialPort::ReadError) {
-        qDebug()<<"An I/O error occurred while reading the data from port"<<m_port->portName()<<", error:"<<m_port->errorString();
+        LOG_ERROR("An I/O error occurred while reading the data from port %s, error: %s", qPrintable(m_port->portName()), qPrintable(m_port->errorString()));
         //consoleOutput("PC: An I/O error occurred while reading the data from port: "+port->errorString(), MsgType::alert);
     }
     else if (serialPortError == QSerialPort::WriteError)
     {
-        qDebug()<<"An I/O error occurred while writing the data to port"<<m_port->portName()<<", error:"<<m_port->errorString();
+        LOG_ERROR("An I/O error occurred while writing the data to port %s, error: %s", qPrintable(m_port->portName()), qPrintable(m_port->errorString()));
         //consoleOutput("PC: An I/O error occurred while writing the data to port: "+m_serialPort->errorString(), MsgType::alert);
     }
     else if (serialPortError == QSerialPort::ResourceError)
     {
+        stopConnecting(ConnectState::Idle);
+        // an upload in progress must not keep writing to the dead handle
+        if (m_currentCommand == Commands::Program || m_currentCommand == Commands::DownloadLine)
+            finishUpload(false, "Error: Device removed");
+        m_sender->stop();
+        m_uploadTimer->stop();
         if (m_port->isOpen())
         {
             m_connected = false;
@@ -145,133 +523,111 @@ void Serial::handleError(QSerialPort::SerialPortError serialPortError)
         }
         m_count = 0;
         connected(false, "The device "+m_port->portName()+" has been removed from the system");
+        if (m_runningJobs)
+            finishJobs(false, "Error: Device removed");
     }
 }
 
-void Serial::parse(const QByteArray readData)
+void Serial::handleReply(const QByteArray &readData)
 {
     switch (m_currentCommand) {
     case Commands::Connect:
     {
+        m_unansweredProbes = qMax(0, m_unansweredProbes - 1);
+        if (m_connectState == ConnectState::Draining)
+        {
+            // the reply to a surplus probe, not to the next command
+            if (m_unansweredProbes == 0)
+                completeHandshake();
+            break;
+        }
         if (readData.contains("c45b2"))
         {
             m_connected = true;
-            qDebug() << "Connected";
+            LOG_INFO("Connected to %s at %d baud", qPrintable(m_port->portName()), m_port->baudRate());
         }
-        else if (readData.contains(QString("%1-\n\r>").arg(QChar(Serial::XOFF)).toStdString().c_str()))
+        else if (readData.contains(QByteArray(1, Serial::XOFF) + "-\n"))
         {
             m_connected = true;
             m_activeBootloader = true;
-            qDebug() << "Found already activated bootloader";
+            LOG_INFO("Found already activated bootloader");
         }
 
-        if (!m_activeBootloader && !readData.contains("c45b2"))
+        if (!m_connected && m_autoBaud)
+        {
+            // noise at a wrong rate; keep probing until the timeout moves on
+            break;
+        }
+        if (!m_connected)
         {
+            stopConnecting(ConnectState::Idle);
+            m_currentCommand = Commands::Idle;
+            m_port->close();
             connected(false, "Error: Wrong bootloader version: "+readData);
+            break;
         }
 
-        if (m_activeBootloader)
+        // the banner ends probing right away, not at the next resend
+        m_trace.record(UploadTrace::Event::Connected);
+        m_handshakeNs = m_connectClock.nsecsElapsed();
+        LOG_INFO("Handshake took %.3f ms and %d probes", m_handshakeNs / 1e6, m_probes);
+        if (m_autoBaud)
         {
-            connected(true, "Warning: bootloader was already active - could not check for compatible version");
+            storeBaudRate(baudRateCacheKey(), m_port->baudRate());
+            m_baudCandidates.clear();
+            emit baudRateDetected(m_port->baudRate());
         }
-        else
+        // readData is only borrowed
+        m_banner = QByteArray(readData.constData(), readData.size());
+        if (m_unansweredProbes > 0)
         {
-            connected(true, "===WELCOME TO Bootloader "+readData.mid(5).simplified()+"===");
+            // Their replies would arrive after connected(true) and be taken
+            // for the answer to the next command
+            stopConnecting(ConnectState::Draining);
+            m_connectTimer->start(2 * probeExchangeMs(m_port->baudRate()) * m_unansweredProbes + CONNECT_RESEND_INITIAL);
+            break;
         }
-        m_currentCommand = Commands::Idle;
+        completeHandshake();
         break;
     }
     case Commands::Program:
     {
         QString reply = readData;
         reply = reply.replace(QChar(0x13), "").trimmed();
-        m_cmd.chop(1);
-        QString expected = m_cmd + QString("+");
-        if (!reply.startsWith(expected))
+        const QString command = m_cmd.trimmed();
+        if (!reply.startsWith(command + "+"))
         {
-            qDebug() << "Error: Bootloader did not respond to '" << m_cmd << "' command";
+            LOG_ERROR("Bootloader did not respond to '%s' command", qPrintable(command));
             //verbose
-            qDebug() << "Reply: " << reply;
+            LOG_DEBUG("Reply: %s", qPrintable(reply));
+            finishUpload(false, "Error: Bootloader did not respond to '"+command+"' command");
             break;
         }
+        if (m_runningJobs)
+            m_jobTimer->start();
 
         // Send to bootloader
-        qDebug() << "Programming " << (m_cmd == "pf" ? "flash" : "EEPROM") << " memory...";
+        LOG_INFO("Programming %s memory...", command == "pf" ? "flash" : "EEPROM");
 
-        QStringList hexFileLines = m_hexFile.getHexFile();
-        quint32 lineNr = 0;
-        qDebug()<<"lines in hex: "<<hexFileLines.count();
-        foreach(QString line, hexFileLines)
-        {
-            ++lineNr;
-            if (!prepareCommandAndWrite(Commands::DownloadLine, line.toUtf8()))
-            {
-                qDebug() << "Error: Failed to download line " << lineNr;
-                break;
-            }
-            //emit uploadedProgress(qRound(double(lineNr/hexFileLines.count()*100)));
-        }
+        m_trace.record(UploadTrace::Event::UploadStart);
+        HexEncoder encoder = m_isErase ? HexEncoder(m_fill) : HexEncoder(m_hexFile);
+        encoder.setRecordLength(m_recordLength);
+        encoder.setPageSize(FLASH_PAGE_SIZE);
+        if (m_skipErased)
+            encoder.setSkipErasedPages(FLASH_PAGE_SIZE);
+        // The bootloader acknowledges every flash page and every EEPROM
+        // record. Nothing walks the image before the first write: progress
+        // starts against bounds from the segment sizes, and the exact counts
+        // replace them once the sender has queued the last record.
+        m_pageTotal = m_doFlash ? encoder.pageBound(FLASH_PAGE_SIZE) : encoder.recordBound();
+        m_pageTotalExact = false;
+        m_progress.start(m_pageTotal, encoder.sizeBound());
+        // Records are encoded one at a time as the window opens, so the
+        // first one goes out without waiting for the rest of the image
+        m_sender->start(encoder);
         m_currentCommand = Commands::DownloadLine;//Commands::Idle;
         break;
     }
-    case Commands::DownloadLine:
-    {
-        if( readData.contains('-') )
-        {
-            m_uploadTimer->stop();
-            qDebug() << "Something went wrong during programming";
-            m_count = 0;
-            m_port->clear();
-            m_port->flush();
-            emit firmwareUploaded(false, "Something went wrong during programming :(");
-            m_currentCommand = Commands::Idle;
-            break;
-        }
-        if (!readData.contains('.') && !readData.contains('*'))
-        {
-            m_uploadTimer->stop();
-            if (readData.isEmpty())
-                qDebug() << "Timeout";
-            else if (readData.contains('\r'))
-            {
-                m_count = 0;
-                m_port->clear();
-                m_port->flush();
-                emit firmwareUploaded(true);
-                m_currentCommand = Commands::Idle;
-                break;
-            }
-            else
-                qDebug() << "Reply: " << readData;
-            m_count = 0;
-            m_port->clear();
-            m_port->flush();
-            emit firmwareUploaded(false);
-            m_currentCommand = Commands::Idle;
-            break;
-        }
-        // ...and with '*' on page write
-        //uploadedProgress(qRound(double(readData.count('*')*128*2/30120*100)));
-        if (readData.contains('*'))
-        {
-            m_uploadTimer->start(1000);
-            m_count++;
-            double size = qCeil(m_hexFile.size()/(m_doFlash ? 128.0 : 16.0));
-            uploadedProgress(qRound(m_count/size*100));
-            //qDebug() << "hex file size" << m_hexFile.size();
-            qDebug() << m_count << "out of" << size<< ":" << qRound(m_count/size*100) << "%";
-        }
-        if (readData.contains('\r'))
-        {
-            m_uploadTimer->stop();
-            m_count = 0;
-            m_port->clear();
-            m_port->flush();
-            emit firmwareUploaded(true);
-            m_currentCommand = Commands::Idle;
-        }
-        break;
-    }
     case Commands::Disconnect:
     {
         if (readData.contains("g+"))
@@ -309,42 +665,40 @@ bool Serial::prepareCommandAndWrite(const Commands command, const QString values
 
 void Serial::on_tryConnectTimeout()
 {
-    static QTime t;
-    static bool started = false;
-    if (!started)
+    if (m_connectState == ConnectState::Draining)
     {
-        started = true;
-        t.start();
+        // a probe that was never answered; nothing more is coming
+        completeHandshake();
+        return;
     }
-    if (t.elapsed() >= m_connectionTimeout)
+    if (m_connectState != ConnectState::Probing)
+        return;
+    if (m_rateClock.elapsed() < m_connectionTimeout)
     {
-        started = false;
-        m_connectTimer->stop();
-        if (!m_connected)
-        {
-            m_port->close();
-            connected(false, "Error: No initial reply from bootloader");
-            return;
-        }
-    }
-    if (!m_connected)
-    {
-        QString cmd = "UUUU\n";
-        prepareCommandAndWrite(Commands::Connect, cmd);
-    }
-    else if (m_connected)
-    {
-        started = false;
-        m_connectTimer->stop();
-        //emit connected(true);
+        sendProbe();
+        return;
     }
+    if (tryNextBaudRate())
+        return;
+    stopConnecting(ConnectState::Idle);
+    m_currentCommand = Commands::Idle;
+    m_port->close();
+    connected(false, m_autoBaud ? "Error: No reply from bootloader at any baud rate"
+                                : "Error: No initial reply from bootloader");
+}
+
+void Serial::on_jobTimeout()
+{
+    if (!m_runningJobs)
+        return;
+    LOG_ERROR("Job %d of %d timed out", m_jobIndex, m_jobCount);
+    if (m_currentCommand == Commands::Program || m_currentCommand == Commands::DownloadLine)
+        finishUpload(false, "Error: No reply from bootloader");
+    else
+        finishJobs(false, "Error: No reply from bootloader");
 }
 
 void Serial::on_uploadTimeout()
 {
-    m_count = 0;
-    m_port->clear();
-    m_port->flush();
-    emit firmwareUploaded(false, "Upload timeout: probably you have less flash/eeprom size available than you specified...");
-    m_currentCommand = Commands::Idle;
+    finishUpload(false, "Upload timeout: probably you have less flash/eeprom size available than you specified...");
 }
@@ -1,20 +1,48 @@
 #ifndef SERIAL_H
 #define SERIAL_H
 
+#include <QElapsedTimer>
 #include <QObject>
 #include <QSerialPort>
 
 #include "commands.h"
+#include "common/hexencoder.h"
 #include "common/hexfile.h"
+#include "common/uploadtrace.h"
+#include "progressmeter.h"
 
 class QTimer;
+class LineSender;
 
 class Serial : public QObject
 {
     Q_OBJECT
 public:
+    // One step of a session run by runJobs()
+    struct Job
+    {
+        enum class Type : quint8
+        {
+            Program,
+            Erase,
+            StartApplication,   // 'g', ends the session
+        };
+
+        static Job program(const HexFile &image, bool doFlash, bool skipErased = false);
+        static Job erase(quint32 size, bool doFlash);
+        static Job startApplication();
+
+        Type type = Type::Program;
+        bool doFlash = true;
+        bool skipErased = false;
+        HexFile image;
+        quint32 size = 0;
+    };
+
     explicit Serial(QObject *parent = nullptr);
     ~Serial();
+    // baudRate AUTO_BAUD probes AUTO_BAUD_RATES from fastest to slowest,
+    // starting with the rate that last worked for this port and adapter
     bool tryConnectToBootloader(QString port, qint32 baudRate, int connectionTimeout=2000);
     void disconnectFromBootloader();
     QString portName() const;
@@ -22,42 +50,141 @@ public:
     void clear() const;
     void close() const;
 
-    void program(const HexFile &hexFile, bool doFlash);
+    // skipErased leaves out flash pages that are entirely 0xFF
+    void program(const HexFile &hexFile, bool doFlash, bool skipErased = false);
+    // Writes size bytes of 0xFF from address 0; the records are generated
+    // as the upload goes, no image is built
+    void erase(quint32 size, bool doFlash);
+
+    // Runs jobs back to back on the connected bootloader: each step is sent
+    // from the reply that ends the previous one, so the line never waits for
+    // the caller. Jobs added while others run are appended. A failed step
+    // drops the rest; so does StartApplication, which has to be last.
+    void runJobs(const QList<Job> &jobs);
+
+    // While connecting, UUUU is sent as soon as the port opens and then
+    // again after initialMs, the wait growing by factor up to maxMs
+    void setConnectBackoff(int initialMs, int maxMs, qreal factor = 2.0);
+
+    // Data bytes per uploaded record (HexEncoder::setRecordLength)
+    void setRecordLength(int bytes);
+    int recordLength() const {return m_recordLength;}
+
+    // Protocol timing; on by default
+    void setTracing(bool enabled) {m_trace.setEnabled(enabled);}
+    const UploadTrace& trace() const {return m_trace;}
+
+    // Minimum time and percentage change between progress reports
+    void setProgressThrottle(int minIntervalMs, int minStepPercent);
+
+    // Upload queue depth and time spent held off by XOFF
+    qint64 inFlight() const;
+    qint64 stallTime() const;
+
+    static const qint32 AUTO_BAUD = 0;
+    static const QList<qint32> AUTO_BAUD_RATES;
+    // Time each candidate rate gets to produce the c45b2 banner
+    static const int AUTO_BAUD_TIMEOUT = 300;
+
+    static const int CONNECT_RESEND_INITIAL = 20;
+    static const int CONNECT_RESEND_MAX = 200;
 
     static const char XON  = 0x11;
     static const char XOFF = 0x13;
 
 signals:
-    void do_parse(const QByteArray readData, QPrivateSignal);
     void connected(bool, const QString &msg="");
-    void uploadedProgress(int progress);
+    void baudRateDetected(qint32 baudRate);
+    // Time from opening the port to the bootloader's reply, and the number
+    // of UUUU probes it took; emitted just before connected(true), which
+    // waits until the replies to surplus probes have been read
+    void handshakeCompleted(qint64 latencyNs, int probes);
+    // Coalesced by ProgressMeter; bytesPerSecond counts hex records written
+    // to the device, etaMs is -1 until it can be estimated
+    void uploadedProgress(int progress, qint64 bytesPerSecond = 0, qint64 etaMs = -1);
     void firmwareUploaded(bool, const QString &msg="");
+    // index counts from 0 over all jobs of the run
+    void jobStarted(int index, int count);
+    void jobsFinished(bool, const QString &msg="");
 
 private slots:
     void on_tryConnectTimeout();
     void on_uploadTimeout();
+    void on_jobTimeout();
 
 private:
     void handleBytesWritten(qint64 bytes);
     void handleReadyRead();
     void handleError(QSerialPort::SerialPortError serialPortError);
-    void parse(const QByteArray readData);
+    void consume(char c);
+    void handleReply(const QByteArray &readData);
+    void handleUploadReply(char c);
+    void updateUploadTotals();
+    void finishUpload(bool ok, const QString &msg = QString());
+    void startNextJob();
+    void finishJobs(bool ok, const QString &msg = QString());
     //bool downloadLine(QString s);
+    enum class ConnectState
+    {
+        Idle,
+        Probing,    // UUUU sent, waiting for the banner
+        Draining,   // banner seen, reading the replies to surplus probes
+        Connected,
+    };
+    void startProbing();
+    void sendProbe();
+    void stopConnecting(ConnectState state);
+    void completeHandshake();
+    bool tryNextBaudRate();
+    QString baudRateCacheKey() const;
     bool prepareCommandAndWrite(const Commands command, const QString values, HexFile hexFile = HexFile());
 
     QSerialPort* m_port;
+    LineSender* m_sender;
+    UploadTrace m_trace;
     bool m_connected = false;
     bool m_activeBootloader = false;
     int m_connectionTimeout = 2000;
+    QList<qint32> m_baudCandidates;
+    bool m_autoBaud = false;
     QTimer* m_connectTimer;
+    ConnectState m_connectState = ConnectState::Idle;
+    // since the port was opened, and since probing at the current rate
+    QElapsedTimer m_connectClock;
+    QElapsedTimer m_rateClock;
+    int m_resendInitial = CONNECT_RESEND_INITIAL;
+    int m_resendMax = CONNECT_RESEND_MAX;
+    qreal m_resendFactor = 2.0;
+    int m_resendInterval = CONNECT_RESEND_INITIAL;
+    int m_probes = 0;
+    // probes at the current rate that have not been answered yet
+    int m_unansweredProbes = 0;
+    qint64 m_handshakeNs = 0;
+    QByteArray m_banner;
     QTimer* m_uploadTimer;
-    QByteArray m_readData;
+    QTimer* m_jobTimer;
+    // Reply line being assembled; replies are short, so a fixed buffer
+    static const int REPLY_CAPACITY = 128;
+    char m_reply[REPLY_CAPACITY];
+    int m_replyLength = 0;
     QByteArray m_writeData;
 
     int m_count = 0;
+    // a bound until the sender has queued the last record, then exact
+    int m_pageTotal = 0;
+    bool m_pageTotalExact = false;
+    ProgressMeter m_progress;
     bool m_doFlash;
+    bool m_skipErased = false;
+    int m_recordLength = HexEncoder::DEFAULT_RECORD_LENGTH;
     QString m_cmd;
     HexFile m_hexFile;
+    bool m_isErase = false;
+    FillRegion m_fill = FillRegion();
+    QList<Job> m_jobs;
+    int m_jobIndex = 0;
+    int m_jobCount = 0;
+    bool m_runningJobs = false;
     Commands m_currentCommand = Commands::Idle;
     Commands m_currentWriteCommand = Commands::Idle;
 };
@@ -0,0 +1,121 @@
+#include "serialthread.h"
+
+#include "serial.h"
+
+SerialThread::SerialThread(QObject *parent) : QObject(parent)
+{
+    m_thread.setObjectName("serial-io");
+    // no parent, so the port and timers created by Serial move with it
+    m_serial = new Serial;
+    m_serial->moveToThread(&m_thread);
+    connect(&m_thread, &QThread::finished, m_serial, &QObject::deleteLater);
+    connect(m_serial, &Serial::connected, this, &SerialThread::connected);
+    connect(m_serial, &Serial::baudRateDetected, this, &SerialThread::baudRateDetected);
+    connect(m_serial, &Serial::handshakeCompleted, this, &SerialThread::handshakeCompleted);
+    connect(m_serial, &Serial::uploadedProgress, this, &SerialThread::uploadedProgress);
+    connect(m_serial, &Serial::firmwareUploaded, this, &SerialThread::firmwareUploaded);
+    connect(m_serial, &Serial::jobStarted, this, &SerialThread::jobStarted);
+    connect(m_serial, &Serial::jobsFinished, this, &SerialThread::jobsFinished);
+    m_thread.start(QThread::HighPriority);
+}
+
+SerialThread::~SerialThread()
+{
+    m_thread.quit();
+    m_thread.wait();
+}
+
+void SerialThread::tryConnectToBootloader(const QString &port, qint32 baudRate, int connectionTimeout)
+{
+    Serial* serial = m_serial;
+    QMetaObject::invokeMethod(serial, [=]() {
+        if (!serial->tryConnectToBootloader(port, baudRate, connectionTimeout))
+            emit serial->connected(false, "Error: Could not open port "+port);
+    }, Qt::QueuedConnection);
+}
+
+void SerialThread::disconnectFromBootloader()
+{
+    Serial* serial = m_serial;
+    QMetaObject::invokeMethod(serial, [=]() { serial->disconnectFromBootloader(); }, Qt::QueuedConnection);
+}
+
+void SerialThread::program(const HexFile &hexFile, bool doFlash, bool skipErased)
+{
+    Serial* serial = m_serial;
+    // HexFile shares its segments, so the copy into the lambda is cheap
+    QMetaObject::invokeMethod(serial, [=]() { serial->program(hexFile, doFlash, skipErased); }, Qt::QueuedConnection);
+}
+
+void SerialThread::erase(quint32 size, bool doFlash)
+{
+    Serial* serial = m_serial;
+    QMetaObject::invokeMethod(serial, [=]() { serial->erase(size, doFlash); }, Qt::QueuedConnection);
+}
+
+void SerialThread::runJobs(const QList<Serial::Job> &jobs)
+{
+    Serial* serial = m_serial;
+    QMetaObject::invokeMethod(serial, [=]() { serial->runJobs(jobs); }, Qt::QueuedConnection);
+}
+
+void SerialThread::setRecordLength(int bytes)
+{
+    Serial* serial = m_serial;
+    QMetaObject::invokeMethod(serial, [=]() { serial->setRecordLength(bytes); }, Qt::QueuedConnection);
+}
+
+void SerialThread::setTracing(bool enabled)
+{
+    Serial* serial = m_serial;
+    QMetaObject::invokeMethod(serial, [=]() { serial->setTracing(enabled); }, Qt::QueuedConnection);
+}
+
+void SerialThread::setConnectBackoff(int initialMs, int maxMs, qreal factor)
+{
+    Serial* serial = m_serial;
+    QMetaObject::invokeMethod(serial, [=]() { serial->setConnectBackoff(initialMs, maxMs, factor); }, Qt::QueuedConnection);
+}
+
+QString SerialThread::portName() const
+{
+    QString result;
+    Serial* serial = m_serial;
+    QMetaObject::invokeMethod(serial, [serial, &result]() { result = serial->portName(); }, Qt::BlockingQueuedConnection);
+    return result;
+}
+
+bool SerialThread::isOpen() const
+{
+    bool result = false;
+    Serial* serial = m_serial;
+    QMetaObject::invokeMethod(serial, [serial, &result]() { result = serial->isOpen(); }, Qt::BlockingQueuedConnection);
+    return result;
+}
+
+bool SerialThread::exportTrace(const QString &fileName) const
+{
+    bool result = false;
+    Serial* serial = m_serial;
+    QMetaObject::invokeMethod(serial, [serial, &fileName, &result]() { result = serial->trace().exportChromeTrace(fileName); },
+                              Qt::BlockingQueuedConnection);
+    return result;
+}
+
+QString SerialThread::pageLatencyReport() const
+{
+    QString result;
+    Serial* serial = m_serial;
+    QMetaObject::invokeMethod(serial, [serial, &result]() { result = serial->trace().pageLatencyReport(); },
+                              Qt::BlockingQueuedConnection);
+    return result;
+}
+
+qint64 SerialThread::firstWriteLatency() const
+{
+    qint64 result = -1;
+    Serial* serial = m_serial;
+    QMetaObject::invokeMethod(serial, [serial, &result]() { result = serial->trace().firstWriteLatency(); },
+                              Qt::BlockingQueuedConnection);
+    return result;
+}
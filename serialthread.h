@@ -0,0 +1,56 @@
+#ifndef SERIALTHREAD_H
+#define SERIALTHREAD_H
+
+#include <QObject>
+#include <QThread>
+
+#include "common/hexfile.h"
+#include "serial.h"
+
+// Runs a Serial, its port and timers on a dedicated I/O thread so reply
+// handling and upload timing do not depend on how busy the GUI is. Commands
+// are posted to the worker; its signals arrive queued on the caller's thread.
+class SerialThread : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SerialThread(QObject *parent = nullptr);
+    ~SerialThread();
+
+    // Result is reported through connected(); Serial::AUTO_BAUD probes rates
+    void tryConnectToBootloader(const QString &port, qint32 baudRate, int connectionTimeout=2000);
+    void disconnectFromBootloader();
+    void program(const HexFile &hexFile, bool doFlash, bool skipErased = false);
+    void erase(quint32 size, bool doFlash);
+    void runJobs(const QList<Serial::Job> &jobs);
+    void setRecordLength(int bytes);
+    void setTracing(bool enabled);
+    void setConnectBackoff(int initialMs, int maxMs, qreal factor = 2.0);
+
+    // Ask the worker; briefly blocks until it has answered
+    QString portName() const;
+    bool isOpen() const;
+
+    // Chrome trace JSON of the protocol timing so far
+    bool exportTrace(const QString &fileName) const;
+    QString pageLatencyReport() const;
+    qint64 firstWriteLatency() const;
+
+    // The worker object, for connecting further signals
+    Serial* serial() const {return m_serial;}
+
+signals:
+    void connected(bool, const QString &msg="");
+    void baudRateDetected(qint32 baudRate);
+    void handshakeCompleted(qint64 latencyNs, int probes);
+    void uploadedProgress(int progress, qint64 bytesPerSecond = 0, qint64 etaMs = -1);
+    void firmwareUploaded(bool, const QString &msg="");
+    void jobStarted(int index, int count);
+    void jobsFinished(bool, const QString &msg="");
+
+private:
+    QThread m_thread;
+    Serial* m_serial;
+};
+
+#endif // SERIALTHREAD_H